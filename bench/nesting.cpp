@@ -0,0 +1,57 @@
+// Time reading, printing, copying and destroying an expression nested a
+// million levels deep, none of which may recurse per level.
+//
+//     g++ -std=c++20 -O2 -Iinclude/weasel bench/nesting.cpp -o nesting
+//     ./nesting [depth]
+
+#include "stream.h"
+#include <chrono>
+#include <cstdlib>
+#include <sstream>
+
+using namespace sexpr;
+
+template <typename F>
+static void timed(const char *what, F &&f)
+{
+    auto start = std::chrono::steady_clock::now();
+    f();
+    std::chrono::duration<double, std::milli> spent = std::chrono::steady_clock::now() - start;
+    std::cout << what << ": " << spent.count() << " ms" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    size_t depth = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000000;
+
+    std::string text;
+    text.reserve(depth * 3 + 2);
+    for (size_t i = 0; i < depth; ++i)
+        text += "f(";
+    text += "x";
+    text.append(depth, ')');
+    text += "\n";
+
+    std::optional<object> expr;
+    timed("read", [&] {
+        std::istringstream in(text);
+        expr = read(in);
+    });
+
+    size_t size = 0;
+    timed("print", [&] {
+        std::ostringstream out;
+        print(out, *expr);
+        size = out.str().size();
+    });
+
+    std::optional<object> copy;
+    timed("copy", [&] { copy = *expr; });
+    timed("destroy", [&] {
+        expr.reset();
+        copy.reset();
+    });
+
+    std::cout << depth << " levels, " << size << " bytes printed\n";
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,154 @@
+#include "compile.h"
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+#pragma once
+
+namespace sexpr {
+
+// An adaptive function starts out running baseline code that records the types
+// of the operands seen at each call to a generic builtin. Once it has been
+// called threshold times it is recompiled on the assumption that operands only
+// ever seen with one type will keep it, which lets inference pick specialized
+// implementations for them and for everything computed from them.
+//
+// The assumptions are checked by a guard before each speculative call, which
+// falls back to the generic implementation when they do not hold. The operand
+// stack is the same in both versions of the code, so this is always safe. If
+// guards fail too often the optimized code is discarded and the function goes
+// back to profiling, until it has been deoptimized max_deopts times, after
+// which it stays on the baseline for good.
+
+class adaptive_function {
+public:
+    static constexpr uint64_t max_deopts = 4;
+
+    explicit adaptive_function(list root, uint64_t threshold = 1000)
+    : m_root{std::move(root)}
+    , m_threshold{threshold}
+    , m_baseline{std::make_shared<tier>(m_root, nullptr)} {}
+
+    adaptive_function(const adaptive_function &) = delete;
+    adaptive_function &operator =(const adaptive_function &) = delete;
+
+    object operator ()(std::vector<object> args = {}) {
+        uint64_t calls = m_calls.fetch_add(1, std::memory_order_relaxed) + 1;
+
+        auto optimized = std::atomic_load(&m_optimized);
+        if (optimized) {
+            object res = optimized->code.invoke(std::move(args), optimized->sites.get());
+            if (calls % check_interval == 0 && optimized->misses() > (calls - m_threshold) / miss_ratio)
+                deoptimize(optimized);
+            return res;
+        }
+
+        if (calls >= m_threshold && m_deopts.load(std::memory_order_relaxed) < max_deopts) {
+            optimize();
+            return (*this)(std::move(args));
+        }
+        return m_baseline->code.invoke(std::move(args), m_baseline->sites.get());
+    }
+
+    bool optimized() const { return std::atomic_load(&m_optimized) != nullptr; }
+    uint64_t deopts() const { return m_deopts.load(std::memory_order_relaxed); }
+private:
+    // How often the guard failures of optimized code are checked, and the
+    // fraction of calls that may fail a guard before it is discarded.
+
+    static constexpr uint64_t check_interval = 256;
+    static constexpr uint64_t miss_ratio = 16;
+
+    // A compiled version of the expression along with its call site state.
+
+    struct tier {
+        tier(const list &root, const std::vector<std::vector<type>> *speculation)
+        : tier(root, infer(root, signatures, speculation), speculation == nullptr) {}
+
+        tier(const list &root, typing types, bool profile)
+        : code{link(root, types, profile)}
+        , sites{std::make_unique<call_site[]>(types.sites.size())}
+        , count{types.sites.size()} {
+            auto address = [](const signature *sig) {
+                return reinterpret_cast<void (*)(operand_stack *)>(resolve(sig->symbol));
+            };
+            for (size_t i = 0; i < count; ++i) {
+                const list *call = types.sites[i];
+                auto &site = sites[i];
+                site.arity = call->size();
+                auto guard = types.guards.find(call);
+                if (guard != types.guards.end()) {
+                    site.special = address(types.calls.at(call));
+                    site.generic = address(guard->second.fallback);
+                    site.expect = guard->second.expect;
+                }
+                else if (types.calls.at(call))
+                    site.generic = address(types.calls.at(call));
+            }
+        }
+
+        static native_function link(const list &root, const typing &types, bool profile) {
+            assembler as;
+            auto image = as.link({{"", as.emit(root, types, profile)}}, {});
+            return native_function{image, image->entries().at("")};
+        }
+
+        uint64_t misses() const {
+            uint64_t res = 0;
+            for (size_t i = 0; i < count; ++i)
+                res += sites[i].misses.load(std::memory_order_relaxed);
+            return res;
+        }
+
+        native_function code;
+        std::unique_ptr<call_site[]> sites;
+        size_t count;
+    };
+
+    // Recompile with the types seen by the baseline. An operand is speculated
+    // on only when a single type has been seen for it.
+
+    void optimize() {
+        std::lock_guard<std::mutex> lock{m_lock};
+        if (std::atomic_load(&m_optimized))
+            return;
+
+        std::vector<std::vector<type>> speculation(m_baseline->count);
+        for (size_t i = 0; i < m_baseline->count; ++i) {
+            const auto &site = m_baseline->sites[i];
+            for (size_t j = 0; j < std::min(site.arity, call_site::profiled); ++j) {
+                uint8_t seen = site.seen[j].load(std::memory_order_relaxed);
+                bool single = seen && !(seen & (seen - 1));
+                speculation[i].push_back(single ? type(__builtin_ctz(seen)) : type::any);
+            }
+        }
+        std::atomic_store(&m_optimized, std::make_shared<tier>(m_root, &speculation));
+    }
+
+    // Return to profiling from scratch, so that the next optimization only
+    // sees the types from after the change in behaviour.
+
+    void deoptimize(const std::shared_ptr<tier> &optimized) {
+        std::lock_guard<std::mutex> lock{m_lock};
+        if (std::atomic_load(&m_optimized) != optimized)
+            return;
+
+        for (size_t i = 0; i < m_baseline->count; ++i) {
+            for (auto &seen : m_baseline->sites[i].seen)
+                seen.store(0, std::memory_order_relaxed);
+        }
+        m_deopts.fetch_add(1, std::memory_order_relaxed);
+        m_calls.store(0, std::memory_order_relaxed);
+        std::atomic_store(&m_optimized, std::shared_ptr<tier>{});
+    }
+
+    list m_root;
+    uint64_t m_threshold;
+    std::shared_ptr<tier> m_baseline;
+    std::shared_ptr<tier> m_optimized;
+    std::atomic<uint64_t> m_calls{0};
+    std::atomic<uint64_t> m_deopts{0};
+    std::mutex m_lock;
+};
+
+};
@@ -0,0 +1,238 @@
+#include "pipeline.h"
+#include "pool.h"
+#include <cmath>
+#include <optional>
+
+#pragma once
+
+namespace sexpr {
+
+// The reductions that aggregate forms such as sum($0) apply to a column.
+
+enum class reduction { sum, min, max, count, avg };
+
+namespace {
+// Fold a run of values into four independent accumulators, which breaks the
+// dependency between iterations so that the loop can be vectorized and the
+// accumulators combined at the end.
+
+template <typename T, typename Op>
+static T fold(const T *data, size_t n, T init, Op op)
+{
+    T acc[4] = { init, init, init, init };
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc[0] = op(acc[0], data[i]);
+        acc[1] = op(acc[1], data[i+1]);
+        acc[2] = op(acc[2], data[i+2]);
+        acc[3] = op(acc[3], data[i+3]);
+    }
+    for (; i < n; ++i)
+        acc[0] = op(acc[0], data[i]);
+    return op(op(acc[0], acc[1]), op(acc[2], acc[3]));
+}
+
+template <typename T>
+static T lesser(T a, T b) { return b < a ? b : a; }
+
+template <typename T>
+static T greater(T a, T b) { return a < b ? b : a; }
+
+template <typename T>
+static T identity(reduction kind)
+{
+    switch (kind) {
+    case reduction::min: return std::numeric_limits<T>::max();
+    case reduction::max: return std::numeric_limits<T>::lowest();
+    default:             return T(0);
+    }
+}
+
+template <typename T>
+static T combine(reduction kind, T a, T b)
+{
+    switch (kind) {
+    case reduction::min: return lesser(a, b);
+    case reduction::max: return greater(a, b);
+    default:             return a + b;
+    }
+}
+
+template <typename T>
+static T reduce(reduction kind, const T *data, size_t n)
+{
+    switch (kind) {
+    case reduction::min: return fold(data, n, identity<T>(kind), lesser<T>);
+    case reduction::max: return fold(data, n, identity<T>(kind), greater<T>);
+    default:             return fold(data, n, T(0), [](T a, T b) { return a + b; });
+    }
+}
+};
+
+// An aggregate evaluates an expression once over a whole batch, where the
+// columns may only be referred to through aggregate forms: sum, min, max,
+// count and avg of a single column. All the aggregates of an expression are
+// computed in one pass over the batch. Large batches are split into chunks
+// that are reduced in parallel on a thread pool, each into its own partial
+// result, and the partial results are then merged in order so that the result
+// does not depend on the scheduling. The rest of the expression is compiled as
+// usual, with the results of the aggregates as its arguments.
+
+class aggregate {
+public:
+    // Batches are split into chunks of this many rows.
+
+    static constexpr size_t chunk = 1 << 16;
+
+    struct reducer {
+        reduction kind;
+        uint32_t column;
+        type ty;
+    };
+
+    aggregate(std::vector<reducer> reducers, std::optional<native_function> fn,
+              std::vector<type> schema, pool &workers)
+    : m_reducers{std::move(reducers)}
+    , m_fn{std::move(fn)}
+    , m_schema{std::move(schema)}
+    , m_pool{&workers} {}
+
+    object operator ()(const batch &input) const {
+        if (input.columns.size() < m_schema.size())
+            throw std::invalid_argument("aggregate: Too few columns.");
+        for (size_t i = 0; i < m_schema.size(); ++i) {
+            if (m_schema[i] != type::any && type_of(input.columns[i]) != m_schema[i])
+                throw std::invalid_argument("aggregate: Column of the wrong type.");
+        }
+        size_t rows = input.rows();
+
+        // Every chunk has a partial result per reducer, kept on its own cache
+        // line so that workers do not contend for them.
+
+        struct alignas(64) partial {
+            integer in;
+            real re;
+        };
+        size_t chunks = std::max<size_t>(1, (rows + chunk - 1) / chunk);
+        std::vector<partial> partials(chunks * m_reducers.size());
+        auto work = [&](size_t i) {
+            size_t first = i * chunk;
+            size_t n = std::min(rows, first + chunk) - first;
+            for (size_t j = 0; j < m_reducers.size(); ++j) {
+                const auto &r = m_reducers[j];
+                auto &p = partials[i * m_reducers.size() + j];
+                if (r.kind == reduction::count)
+                    continue;
+                if (auto *col = std::get_if<std::vector<integer>>(&input.columns[r.column]))
+                    p.in = reduce(r.kind, col->data() + first, n);
+                else
+                    p.re = reduce(r.kind, std::get_if<std::vector<real>>(&input.columns[r.column])->data() + first, n);
+            }
+        };
+        if (chunks > 1)
+            m_pool->parallel_for(chunks, work);
+        else
+            work(0);
+
+        std::vector<object> results;
+        for (size_t j = 0; j < m_reducers.size(); ++j) {
+            const auto &r = m_reducers[j];
+            if (r.kind == reduction::count) {
+                results.push_back(integer(rows));
+                continue;
+            }
+            if (!rows && r.kind != reduction::avg && r.kind != reduction::sum)
+                throw std::invalid_argument("aggregate: Extremum of an empty batch.");
+
+            integer in = identity<integer>(r.kind);
+            real re = identity<real>(r.kind);
+            for (size_t i = 0; i < chunks; ++i) {
+                const auto &p = partials[i * m_reducers.size() + j];
+                if (r.ty == type::integer)
+                    in = combine(r.kind, in, p.in);
+                else
+                    re = combine(r.kind, re, p.re);
+            }
+            if (r.kind == reduction::avg)
+                results.push_back((r.ty == type::integer ? real(in) : re) / real(rows));
+            else if (r.ty == type::integer)
+                results.push_back(in);
+            else
+                results.push_back(re);
+        }
+
+        if (!m_fn)
+            return results.front();
+        return (*m_fn)(std::move(results));
+    }
+
+    const std::vector<reducer> &reducers() const { return m_reducers; }
+private:
+    std::vector<reducer> m_reducers;
+    std::optional<native_function> m_fn;
+    std::vector<type> m_schema;
+    pool *m_pool;
+};
+
+// Compile an aggregate over batches whose columns have the types in schema.
+// Each aggregate form is replaced by an argument of the type of its result,
+// and what remains is compiled as an ordinary expression. This is not an
+// overload of compile(), as a braced schema would make calls that leave the
+// options to a brace initializer ambiguous.
+
+aggregate compile_aggregate(const list &expr, const std::vector<type> &schema, pool &workers = pool::shared())
+{
+    static const std::map<std::string, reduction> forms = {
+        { "sum",   reduction::sum },
+        { "min",   reduction::min },
+        { "max",   reduction::max },
+        { "count", reduction::count },
+        { "avg",   reduction::avg }
+    };
+
+    std::vector<aggregate::reducer> reducers;
+    auto replace = [&](const list &form) -> atom {
+        uint32_t column;
+        type ty;
+        auto *at = form.size() == 1 ? std::get_if<atom>(&form.front()) : nullptr;
+        if (!at || !parameter(*at, column, ty))
+            throw std::runtime_error("compile_aggregate: Aggregate of something other than a column.");
+        if (column >= schema.size())
+            throw std::runtime_error("compile_aggregate: No such column.");
+
+        reduction kind = forms.at(form.op);
+        ty = schema[column];
+        if (kind != reduction::count && ty != type::integer && ty != type::real)
+            throw std::runtime_error("compile_aggregate: Aggregate of a column that is not numeric.");
+        reducers.push_back({kind, column, ty});
+
+        type result = kind == reduction::count ? type::integer
+                    : kind == reduction::avg   ? type::real
+                    : ty;
+        return "$" + std::to_string(reducers.size() - 1) + (result == type::integer ? ":int" : ":real");
+    };
+
+    if (forms.count(expr.op)) {
+        replace(expr);
+        return aggregate{std::move(reducers), std::nullopt, schema, workers};
+    }
+
+    list root = expr;
+    std::vector<list *> todo = {&root};
+    while (!todo.empty()) {
+        list *parent = todo.back();
+        todo.pop_back();
+        for (auto &child : *parent) {
+            auto *li = std::get_if<list>(&child);
+            if (li && forms.count(li->op))
+                child = replace(*li);
+            else if (li && !li->op.empty())
+                todo.push_back(li);
+            else if (auto *at = std::get_if<atom>(&child); at && at->size() > 1 && (*at)[0] == '$')
+                throw std::runtime_error("compile_aggregate: Column outside of an aggregate.");
+        }
+    }
+    return aggregate{std::move(reducers), compile(root), schema, workers};
+}
+
+};
@@ -1,81 +1,236 @@
 #include "stream.h"
+#include "infer.h"
+#include "pool.h"
+#include "loop.h"
+#include "disasm.h"
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <cerrno>
 #include <cstdlib>
 #include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <limits>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <sstream>
+#include <stdexcept>
+#include <string_view>
+#include <system_error>
+#include <utility>
 
 #pragma once
 
 namespace sexpr {
 
-class native_function {
-public:
-    native_function(const std::string &buffer, std::vector<object> &&immediates)
-    : m_buffer{nullptr}
-    , m_immediates{immediates} {
-        // Attempt to allocate a contiguous page-aligned region of memory for
-        // the function.
-        
-        const int pagesize = sysconf(_SC_PAGE_SIZE);
-        if (pagesize == -1)
-            throw std::runtime_error("Can't access page size.");
-        
-        int length = (buffer.size() + pagesize-1) / pagesize * pagesize;
-        if (posix_memalign((void **)&m_buffer, pagesize, length))
-            throw std::runtime_error("Cannot create compiled_fn.");
-        memcpy(m_buffer, buffer.data(), buffer.size());
-        
-        // Mark the region as executable. This is required on modern hardware as
-        // the heap is restricted from execution by default to prevent code
-        // injection attacks.
-        
-        mprotect(m_buffer, length, PROT_READ | PROT_EXEC);
-    }
-    
-    const object &immediate(uint32_t idx) const {
-        return m_immediates[idx];
-    }
-    
-    void operator ()() {
-        std::vector<object> stack;
-        (*reinterpret_cast<void (*)(std::vector<object> *, native_function *)>(m_buffer))(&stack, this);
-    }
-private:
-    std::vector<object> m_immediates;
-    char *m_buffer;
+// Compiled code is handed the operand stack in rdi and a context in rsi,
+// through which the helpers that it calls find the state of the invocation.
+// The batch, selection and row count are only used by pipelines, the code,
+// workers and forks only by code that evaluates subtrees in parallel, the
+// suspension only by code that calls asynchronous builtins, and the fuel only
+// by metered code.
+//
+// Compiled code has no unwind information, so nothing may be thrown through
+// it. Helpers that can fail leave the exception in the context and return
+// false instead, on which the code returns at once, and whoever called the
+// code rethrows it.
+
+struct context {
+    const std::vector<object> *immediates;
+    const std::vector<object> *args;
+    struct call_site *sites;
+    struct inline_cache *caches;
+    const struct batch *batch;
+    struct selection *selection;
+    size_t rows;
+    const char *code;
+    pool *workers;
+    std::vector<std::unique_ptr<struct fork_frame>> *forks;
+    struct suspension *suspended;
+    int64_t *fuel;
+    std::exception_ptr *error;
+};
+
+// The subtrees forked for a call by the current invocation, and their values
+// once they have been computed, or what they failed with.
+
+struct fork_frame {
+    pool::group group;
+    std::vector<object> values;
+    std::vector<int64_t> spent;
+    std::vector<std::exception_ptr> errors;
+};
+
+// An asynchronous builtin is handed its operands and must eventually call done
+// with its result, from any thread. Calls to it end the segment of code that
+// is running, leaving the builtin and its operands in the suspension of the
+// invocation to be started by whoever drives the evaluation.
+
+using async_builtin = void (*)(std::vector<object> operands, std::function<void(object)> done);
+
+struct suspension {
+    async_builtin fn = nullptr;
+    std::vector<object> operands;
+};
+
+// A source map attributes a range of code to the node of the expression that
+// it evaluates, which is given by the indices of the children leading to it
+// from the root.
+
+struct span {
+    size_t begin;
+    size_t end;
+    std::vector<uint32_t> path;
+};
+
+// An entry point into the code of an image, along with the types that its
+// parameters were annotated with. Code that calls asynchronous builtins is
+// split into segments, and evaluation resumes at the offsets that follow the
+// first. The code of an entry point, including that of the subtrees that it
+// forks, takes up size bytes from its offset.
+
+struct entry {
+    size_t offset;
+    std::vector<type> params;
+    std::vector<size_t> resumes;
+    size_t size = 0;
+    std::vector<span> spans;
+};
+
+// The runtime state of a call site in code that gathers type feedback or
+// speculates on it. Baseline code records a mask of the types seen for the
+// first few operands of each call, and speculative code checks the operands
+// against the expected types before calling the specialized implementation.
+
+struct call_site {
+    static constexpr size_t profiled = 4;
+
+    void (*generic)(operand_stack *) = nullptr;
+    void (*special)(operand_stack *) = nullptr;
+    size_t arity = 0;
+    std::vector<type> expect;
+    std::atomic<uint8_t> seen[profiled]{};
+    std::atomic<uint64_t> misses{0};
+};
+
+// An inline cache serves a call to an overloaded builtin whose operand types
+// are unknown until runtime. It remembers the implementations chosen for the
+// last few combinations of operand types, so that only the first call with a
+// new combination pays for a full resolution. Each entry packs the operand
+// types in its upper half and the index of the implementation plus one in its
+// lower half, so that it can be read and written atomically.
+
+struct inline_cache {
+    static constexpr size_t ways = 4;
+
+    std::string name;
+    size_t arity = 0;
+    std::vector<const signature *> candidates;
+    std::vector<void (*)(operand_stack *)> targets;
+    std::atomic<uint64_t> entries[ways]{};
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+};
+
+// Hit and miss counts of an inline cache, identified by the builtin it calls.
+
+struct cache_stats {
+    std::string name;
+    uint64_t hits;
+    uint64_t misses;
 };
 
 namespace {
-// Builtin functions.
+// Builtin functions. The generic implementations accept operands of any type
+// and parse atoms that spell numbers at runtime. The specialized ones are only
+// called where inference has proven the operand types, so they do no checks.
+
+using number = std::variant<integer, real>;
+
+static number to_number(const object &obj)
+{
+    if (auto *in = std::get_if<integer>(&obj))
+        return *in;
+    if (auto *re = std::get_if<real>(&obj))
+        return *re;
+    if (auto *at = std::get_if<atom>(&obj)) {
+        object lit = literal(*at);
+        if (auto *in = std::get_if<integer>(&lit))
+            return *in;
+        if (auto *re = std::get_if<real>(&lit))
+            return *re;
+    }
+    throw std::invalid_argument("Not a number.");
+}
+
+static void op_add(operand_stack *stack)
+{
+    auto it = stack->end();
+    auto a = to_number(*--it);
+    auto b = to_number(*--it);
+    stack->pop_back();
+    stack->back() = std::visit([](auto a, auto b) -> object { return b + a; }, a, b);
+}
+
+template <typename T>
+static void op_add_(operand_stack *stack)
+{
+    auto it = stack->end();
+    auto a = *std::get_if<T>(&*--it);
+    auto b = *std::get_if<T>(&*--it);
+    stack->pop_back();
+    stack->back() = b + a;
+}
 
-static void op_add(std::vector<object> *stack)
+static void op_mul(operand_stack *stack)
 {
     auto it = stack->end();
-    auto a = std::stol(*std::get_if<atom>(&*--it));
-    auto b = std::stol(*std::get_if<atom>(&*--it));
+    auto a = to_number(*--it);
+    auto b = to_number(*--it);
     stack->pop_back();
-    stack->back() = atom{std::to_string(a + b)};
+    stack->back() = std::visit([](auto a, auto b) -> object { return b * a; }, a, b);
 }
 
-static void op_mul(std::vector<object> *stack)
+template <typename T>
+static void op_mul_(operand_stack *stack)
 {
     auto it = stack->end();
-    auto a = std::stol(*std::get_if<atom>(&*--it));
-    auto b = std::stol(*std::get_if<atom>(&*--it));
+    auto a = *std::get_if<T>(&*--it);
+    auto b = *std::get_if<T>(&*--it);
     stack->pop_back();
-    stack->back() = atom{std::to_string(a * b)};
+    stack->back() = b * a;
 }
 
-static void op_print(std::vector<object> *stack) {
+static void op_print(operand_stack *stack) {
     print(std::cout, stack->back()) << std::endl;
 }
 
-static const std::map<std::string, uintptr_t> builtins = {
-    { "+",     reinterpret_cast<uintptr_t>(op_add) },
-    { "*",     reinterpret_cast<uintptr_t>(op_mul) },
-    { "print", reinterpret_cast<uintptr_t>(op_print) }
+static std::map<std::string, uintptr_t> builtins = {
+    { "+",      reinterpret_cast<uintptr_t>(op_add) },
+    { "+/int",  reinterpret_cast<uintptr_t>(op_add_<integer>) },
+    { "+/real", reinterpret_cast<uintptr_t>(op_add_<real>) },
+    { "*",      reinterpret_cast<uintptr_t>(op_mul) },
+    { "*/int",  reinterpret_cast<uintptr_t>(op_mul_<integer>) },
+    { "*/real", reinterpret_cast<uintptr_t>(op_mul_<real>) },
+    { "print",  reinterpret_cast<uintptr_t>(op_print) }
+};
+
+static std::multimap<std::string, signature> signatures = {
+    { "+",     { "+",      { type::any, type::any },         type::any } },
+    { "+",     { "+/int",  { type::integer, type::integer }, type::integer } },
+    { "+",     { "+/real", { type::real, type::real },       type::real } },
+    { "*",     { "*",      { type::any, type::any },         type::any } },
+    { "*",     { "*/int",  { type::integer, type::integer }, type::integer } },
+    { "*",     { "*/real", { type::real, type::real },       type::real } },
+    { "print", { "print",  { type::any },                    type::any, 1, false } }
 };
 
 // The imm<> type aids in serializing unsigned integers to streams in the LSB
@@ -84,7 +239,7 @@ static const std::map<std::string, uintptr_t> builtins = {
 template <typename T> struct imm { T val; };
 template <typename T>
 std::ostream &operator <<(std::ostream &out, const imm<T> &imm) {
-    for (int i = 0; i < sizeof(T) * 8; i += 8)
+    for (size_t i = 0; i < sizeof(T) * 8; i += 8)
         out.put((imm.val >> i) & 0xff);
     return out;
 }
@@ -92,79 +247,1662 @@ std::ostream &operator <<(std::ostream &out, const imm<T> &imm) {
 // We need a proxy function here since method functions are not guarenteed to
 // have machine addresses, which does not help us when calling from assembly!
 
-static void do_push_imm(std::vector<object> *stack, native_function *fn, uint32_t idx){
-    stack->push_back(fn->immediate(idx));
-};
-};
-
-native_function compile(const list &root)
-{   
-    // The x64 instructions that we will need when building the function are
-    // defined here:
-
-    const char *call_rax      = "\xff\xd0";
-    const char *push_rdi      = "\x57";
-    const char *pop_rdi       = "\x5f";
-    const char *push_rsi      = "\x56";
-    const char *pop_rsi       = "\x5e";
-    const char *mov_rax_imm64 = "\x48\xb8";
-    const char *mov_rdx_imm32 = "\xba";
-    const char *sub_rsp_8     = "\x48\x83\xec\x08";
-    const char *add_rsp_8     = "\x48\x83\xc4\x08";
-    const char *ret           = "\xc3";
-    
-    struct frame {
-        std::reference_wrapper<const list> parent;
-        list::const_iterator it;
+static void do_push_imm(operand_stack *stack, const context *ctx, uint32_t idx){
+    stack->push_back((*ctx->immediates)[idx]);
+};
+
+static void do_push_arg(operand_stack *stack, const context *ctx, uint32_t idx){
+    stack->push_back((*ctx->args)[idx]);
+};
+
+static void profile(operand_stack *stack, const context *ctx, uint32_t idx){
+    auto &site = ctx->sites[idx];
+    auto it = stack->end() - site.arity;
+    for (size_t i = 0; i < std::min(site.arity, call_site::profiled); ++i)
+        site.seen[i].fetch_or(1 << int(type_of(it[i])), std::memory_order_relaxed);
+    site.generic(stack);
+};
+
+static void guard(operand_stack *stack, const context *ctx, uint32_t idx){
+    auto &site = ctx->sites[idx];
+    auto it = stack->end() - site.arity;
+    for (size_t i = 0; i < site.arity; ++i) {
+        if (site.expect[i] != type::any && type_of(it[i]) != site.expect[i]) {
+            site.misses.fetch_add(1, std::memory_order_relaxed);
+            site.generic(stack);
+            return;
+        }
+    }
+    site.special(stack);
+};
+
+static void dispatch(operand_stack *stack, const context *ctx, uint32_t idx){
+    auto &ic = ctx->caches[idx];
+    auto it = stack->end() - ic.arity;
+    uint64_t key = 0;
+    for (size_t i = 0; i < ic.arity; ++i)
+        key |= uint64_t(type_of(it[i])) << (8 * i);
+    key <<= 32;
+
+    bool cacheable = ic.arity <= sizeof(uint32_t);
+    if (cacheable) {
+        for (auto &entry : ic.entries) {
+            uint64_t val = entry.load(std::memory_order_relaxed);
+            if (val && (val & ~uint64_t(0xffffffff)) == key) {
+                ic.hits.fetch_add(1, std::memory_order_relaxed);
+                ic.targets[(val & 0xffffffff) - 1](stack);
+                return;
+            }
+        }
+    }
+    uint64_t misses = ic.misses.fetch_add(1, std::memory_order_relaxed);
+
+    std::vector<type> types;
+    for (size_t i = 0; i < ic.arity; ++i)
+        types.push_back(type_of(it[i]));
+    const signature *sig = best(signatures, ic.name, types);
+    auto found = std::find(ic.candidates.begin(), ic.candidates.end(), sig);
+    if (found == ic.candidates.end())
+        throw std::invalid_argument("No matching implementation.");
+    size_t target = found - ic.candidates.begin();
+
+    // Fill the first free entry, or once the cache is full replace the entries
+    // in turn so that it holds the most recent combinations.
+
+    if (cacheable) {
+        uint64_t val = key | (target + 1);
+        bool stored = false;
+        for (auto &entry : ic.entries) {
+            uint64_t empty = 0;
+            if ((stored = entry.compare_exchange_strong(empty, val, std::memory_order_relaxed)))
+                break;
+        }
+        if (!stored)
+            ic.entries[misses % inline_cache::ways].store(val, std::memory_order_relaxed);
+    }
+    ic.targets[target](stack);
+};
+
+// Run a helper that may throw, leaving what it throws in the context for the
+// caller of the compiled code, and returning whether it succeeded.
+
+template <typename F>
+static bool contain(const context *ctx, F &&fn)
+{
+    try {
+        fn();
+        return true;
+    }
+    catch (...) {
+        *ctx->error = std::current_exception();
+        return false;
+    }
+}
+
+static bool do_dispatch(operand_stack *stack, const context *ctx, uint32_t idx){
+    return contain(ctx, [&] { dispatch(stack, ctx, idx); });
+};
+
+static bool do_profile(operand_stack *stack, const context *ctx, uint32_t idx){
+    return contain(ctx, [&] { profile(stack, ctx, idx); });
+};
+
+static bool do_guard(operand_stack *stack, const context *ctx, uint32_t idx){
+    return contain(ctx, [&] { guard(stack, ctx, idx); });
+};
+
+// Builtins are called through here rather than directly, as any of them may
+// throw, with the address that compiled code loaded from the call table.
+
+static bool do_call(operand_stack *stack, const context *ctx, void (*fn)(operand_stack *)){
+    return contain(ctx, [&] { fn(stack); });
+};
+
+// Wait for the tasks of the forks that code bailed out of before joining them,
+// so that none outlives the frame that it writes to. What they fail with is
+// dropped, as the evaluation has already failed.
+
+static void settle(std::vector<std::unique_ptr<fork_frame>> &forks, pool *workers)
+{
+    while (!forks.empty()) {
+        if (workers) {
+            try {
+                workers->wait(forks.back()->group);
+            }
+            catch (...) {}
+        }
+        forks.pop_back();
+    }
+}
+
+// Subtrees that are worth evaluating in parallel are compiled as functions of
+// their own, and the immediate handed to %fork lists their offsets in the code.
+// Each runs as a task with its own operand stack, and %join pushes their values
+// in turn, waiting for all of them on the first. Without a pool they are simply
+// evaluated on the spot. Each task is metered against its own copy of the fuel
+// that remains, and what they spent is charged to the invocation on the join,
+// which fails with what the first of them failed with, and bails out without
+// an error once the fuel has run out, as a task that ran out left no value.
+
+static void do_fork(operand_stack *, const context *ctx, uint32_t idx){
+    const auto &offsets = *std::get_if<list>(&(*ctx->immediates)[idx]);
+    auto &frame = *ctx->forks->emplace_back(std::make_unique<fork_frame>());
+    frame.values.resize(offsets.size(), atom{});
+    frame.spent.resize(offsets.size());
+    frame.errors.resize(offsets.size());
+    for (size_t k = 0; k < offsets.size(); ++k) {
+        auto task = [ctx, &frame, k, offset = *std::get_if<integer>(&offsets[k]), fuel = *ctx->fuel]() mutable {
+            std::vector<std::unique_ptr<fork_frame>> forks;
+            operand_stack stack;
+            context sub = *ctx;
+            sub.forks = &forks;
+            sub.fuel = &fuel;
+            sub.error = &frame.errors[k];
+            int64_t before = fuel;
+            (*reinterpret_cast<void (*)(operand_stack *, const context *)>(ctx->code + offset))(&stack, &sub);
+            settle(forks, ctx->workers);
+            frame.spent[k] = before - fuel;
+            if (!stack.empty())
+                frame.values[k] = std::move(stack.back());
+        };
+        if (ctx->workers)
+            ctx->workers->spawn(frame.group, std::move(task));
+        else
+            task();
+    }
+};
+
+static bool do_join(operand_stack *stack, const context *ctx, uint32_t idx){
+    auto &frame = *ctx->forks->back();
+    if (idx == 0) {
+        if (ctx->workers && !contain(ctx, [&] { ctx->workers->wait(frame.group); }))
+            return false;
+        for (auto &error : frame.errors) {
+            if (error) {
+                *ctx->error = error;
+                return false;
+            }
+        }
+        for (auto spent : frame.spent)
+            *ctx->fuel -= spent;
+        if (*ctx->fuel < 0)
+            return false;
+    }
+    stack->push_back(std::move(frame.values[idx]));
+    if (idx + 1 == frame.values.size())
+        ctx->forks->pop_back();
+    return true;
+};
+
+static void do_await(operand_stack *stack, const context *ctx, uint32_t arity, async_builtin fn){
+    ctx->suspended->fn = fn;
+    ctx->suspended->operands.assign(std::make_move_iterator(stack->end() - arity),
+                                    std::make_move_iterator(stack->end()));
+    stack->erase(stack->end() - arity, stack->end());
+};
+
+// Call an asynchronous builtin and wait for its result on the calling thread.
+
+static object await(async_builtin fn, std::vector<object> operands)
+{
+    std::mutex lock;
+    std::condition_variable done;
+    std::optional<object> result;
+    fn(std::move(operands), [&](object obj) {
+        std::lock_guard<std::mutex> guard{lock};
+        result = std::move(obj);
+        done.notify_one();
+    });
+    std::unique_lock<std::mutex> guard{lock};
+    done.wait(guard, [&] { return result.has_value(); });
+    return std::move(*result);
+}
+
+// Arguments are checked against the annotations of their parameters once on
+// entry, so that the code can rely on them. Atoms that spell a number of the
+// right type are converted.
+
+static void coerce(object &arg, type ty)
+{
+    if (ty == type::any || type_of(arg) == ty)
+        return;
+    if (ty == type::real && std::holds_alternative<integer>(arg)) {
+        arg = real(*std::get_if<integer>(&arg));
+        return;
+    }
+    if (auto *at = std::get_if<atom>(&arg)) {
+        object lit = literal(*at);
+        if (type_of(lit) == ty || (ty == type::real && type_of(lit) == type::integer)) {
+            arg = std::move(lit);
+            coerce(arg, ty);
+            return;
+        }
+    }
+    throw std::invalid_argument("native_function: Argument of the wrong type.");
+}
+
+// Every address that compiled code may call is given a name, so that the call
+// table of an image can be rebuilt in any process from the names alone.
+
+static std::map<std::string, uintptr_t> &symbols()
+{
+    static std::map<std::string, uintptr_t> symbols = [] {
+        auto symbols = builtins;
+        symbols.emplace("%push_imm", reinterpret_cast<uintptr_t>(do_push_imm));
+        symbols.emplace("%push_arg", reinterpret_cast<uintptr_t>(do_push_arg));
+        symbols.emplace("%profile", reinterpret_cast<uintptr_t>(do_profile));
+        symbols.emplace("%guard", reinterpret_cast<uintptr_t>(do_guard));
+        symbols.emplace("%dispatch", reinterpret_cast<uintptr_t>(do_dispatch));
+        symbols.emplace("%fork", reinterpret_cast<uintptr_t>(do_fork));
+        symbols.emplace("%join", reinterpret_cast<uintptr_t>(do_join));
+        symbols.emplace("%await", reinterpret_cast<uintptr_t>(do_await));
+        symbols.emplace("%call", reinterpret_cast<uintptr_t>(do_call));
+        return symbols;
+    }();
+    return symbols;
+}
+
+static uintptr_t resolve(const std::string &name)
+{
+    auto symbol = symbols().find(name);
+    if (symbol == symbols().end())
+        throw std::runtime_error("image: Unknown symbol.");
+    return symbol->second;
+}
+
+// Each inline cache may call any implementation of its builtin that takes the
+// right number of operands.
+
+static void fill(inline_cache &ic, const std::string &name, size_t arity)
+{
+    ic.name = name;
+    ic.arity = arity;
+    auto [first, last] = signatures.equal_range(name);
+    for (auto it = first; it != last; ++it) {
+        if (it->second.params.size() != arity)
+            continue;
+        ic.candidates.push_back(&it->second);
+        ic.targets.push_back(reinterpret_cast<void (*)(operand_stack *)>(
+            resolve(it->second.symbol)));
+    }
+}
+
+static void serialize(std::ostream &out, const object &obj)
+{
+    auto put = [&](const atom &at) {
+        out << imm<uint32_t>{(uint32_t)at.size()} << at;
     };
-    std::vector<struct frame> frames = {{root, root.begin()}};
-    
-    std::vector<object> immediates;
-    std::ostringstream out;
-    out << push_rsi;
-
-    for (;;) {
-        if (frames.back().it == frames.back().parent.get().end()) {
-            auto op = builtins.find(frames.back().parent.get().op);
-            if (op == builtins.end())
-                throw std::runtime_error("compile: Unknown function.");
-            
-            out << push_rdi;
-            out << push_rsi;
-            out << mov_rax_imm64 << imm<uint64_t>{op->second};
-            out << call_rax;
-            out << pop_rsi;
-            out << pop_rdi;
-
-            frames.pop_back();
-            if (frames.empty())
+    if (auto *li = std::get_if<list>(&obj)) {
+        out.put(1);
+        put(li->op);
+        out << imm<uint32_t>{(uint32_t)li->size()};
+        for (const auto &child : *li)
+            serialize(out, child);
+    }
+    else if (auto *at = std::get_if<atom>(&obj)) {
+        out.put(at->quoted ? 4 : 0);
+        put(*at);
+    }
+    else if (auto *in = std::get_if<integer>(&obj)) {
+        out.put(2);
+        out << imm<uint64_t>{(uint64_t)*in};
+    }
+    else if (auto *re = std::get_if<real>(&obj)) {
+        uint64_t bits;
+        memcpy(&bits, re, sizeof(bits));
+        out.put(3);
+        out << imm<uint64_t>{bits};
+    }
+}
+
+// The inverse of imm<>, for reading back what was serialized with it.
+
+template <typename T>
+T get_imm(std::istream &in) {
+    T val = 0;
+    for (size_t i = 0; i < sizeof(T) * 8; i += 8)
+        val |= T(in.get() & 0xff) << i;
+    if (!in)
+        throw std::runtime_error("image: Truncated header.");
+    return val;
+}
+
+static atom get_atom(std::istream &in)
+{
+    atom at(get_imm<uint32_t>(in), '\0');
+    if (!in.read(at.data(), at.size()))
+        throw std::runtime_error("image: Truncated header.");
+    return at;
+}
+
+static object deserialize(std::istream &in)
+{
+    switch (in.get()) {
+    case 0:
+        return get_atom(in);
+    case 4: {
+        atom at = get_atom(in);
+        at.quoted = true;
+        return at;
+    }
+    case 2:
+        return integer(get_imm<uint64_t>(in));
+    case 3: {
+        uint64_t bits = get_imm<uint64_t>(in);
+        real re;
+        memcpy(&re, &bits, sizeof(re));
+        return re;
+    }
+    }
+    list li{get_atom(in)};
+    for (uint32_t n = get_imm<uint32_t>(in); n; --n)
+        li.push_back(deserialize(in));
+    return li;
+}
+};
+
+// An image is the region of executable memory shared by every function of a
+// module. The code for each entry point is laid out back to back, followed on
+// the next page by a call table holding the address of every symbol that the
+// code refers to. Calls are made indirectly through the table, so each address
+// is stored once per module rather than once per call site, and the code itself
+// is position independent.
+//
+// A shared image keeps its code in a sealed memfd, preceded by a header that
+// describes the entry points, symbols and immediates. Other processes can map
+// the same code read only with load(), so a rule set compiled once by a master
+// process costs no further compile time or executable memory in its workers.
+// Only the call table, which is rebuilt from the symbol names, and the inline
+// caches are private to each process, as is the pool that forked subtrees are
+// evaluated on.
+
+class image {
+public:
+    image(std::string_view code, std::vector<std::string> &&symbols,
+          std::vector<object> &&immediates, std::map<std::string, entry> &&entries,
+          std::vector<std::pair<std::string, size_t>> &&dispatches, bool shared,
+          pool *workers = nullptr)
+    : m_immediates{std::move(immediates)}
+    , m_symbols{std::move(symbols)}
+    , m_entries{std::move(entries)}
+    , m_dispatches{std::move(dispatches)}
+    , m_workers{workers}
+    , m_code_size{code.size()} {
+        if (!shared) {
+            map(code.data(), -1, 0);
+            return;
+        }
+
+        std::ostringstream header;
+        header << "weasel04";
+        header << imm<uint64_t>{m_code_size};
+        header << imm<uint32_t>{(uint32_t)m_entries.size()};
+        for (const auto &[name, entry] : m_entries) {
+            header << imm<uint32_t>{(uint32_t)name.size()} << name;
+            header << imm<uint64_t>{entry.offset};
+            header << imm<uint32_t>{(uint32_t)entry.params.size()};
+            for (auto ty : entry.params)
+                header << imm<uint8_t>{(uint8_t)ty};
+            header << imm<uint32_t>{(uint32_t)entry.resumes.size()};
+            for (auto offset : entry.resumes)
+                header << imm<uint64_t>{offset};
+            header << imm<uint64_t>{entry.size};
+            header << imm<uint32_t>{(uint32_t)entry.spans.size()};
+            for (const auto &span : entry.spans) {
+                header << imm<uint64_t>{span.begin} << imm<uint64_t>{span.end};
+                header << imm<uint32_t>{(uint32_t)span.path.size()};
+                for (auto i : span.path)
+                    header << imm<uint32_t>{i};
+            }
+        }
+        header << imm<uint32_t>{(uint32_t)m_symbols.size()};
+        for (const auto &name : m_symbols)
+            header << imm<uint32_t>{(uint32_t)name.size()} << name;
+        header << imm<uint32_t>{(uint32_t)m_immediates.size()};
+        for (const auto &obj : m_immediates)
+            serialize(header, obj);
+        header << imm<uint32_t>{(uint32_t)m_dispatches.size()};
+        for (const auto &[name, arity] : m_dispatches)
+            header << imm<uint32_t>{(uint32_t)name.size()} << name << imm<uint32_t>{(uint32_t)arity};
+
+        // The code is placed at the first page boundary after the header, and
+        // the header size is recorded in the last eight bytes of the page before
+        // it so that load() can find both.
+
+        std::string contents = header.str();
+        size_t code_offset = round(contents.size() + sizeof(uint64_t), pagesize());
+        contents.resize(code_offset - sizeof(uint64_t), '\0');
+        std::ostringstream trailer;
+        trailer << imm<uint64_t>{code_offset};
+        contents += trailer.str();
+        contents += code;
+
+        m_fd = memfd_create("weasel", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if (m_fd == -1)
+            throw std::runtime_error("Cannot create image.");
+        for (size_t done = 0; done < contents.size(); ) {
+            ssize_t n = write(m_fd, contents.data() + done, contents.size() - done);
+            if (n <= 0) {
+                close(m_fd);
+                throw std::runtime_error("Cannot create image.");
+            }
+            done += n;
+        }
+        try {
+            if (fcntl(m_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1)
+                throw std::system_error(errno, std::generic_category(), "image: Cannot seal image");
+            map(nullptr, m_fd, code_offset);
+        }
+        catch (...) {
+            close(m_fd);
+            throw;
+        }
+    }
+
+    // Map the code of a shared image created by another process.
+
+    explicit image(int fd, pool *workers = nullptr)
+    : m_workers{workers}
+    , m_fd{-1} {
+        struct stat st;
+        if (fstat(fd, &st) == -1)
+            throw std::runtime_error("image: Cannot stat.");
+        std::string contents(st.st_size, '\0');
+        if (pread(fd, contents.data(), contents.size(), 0) != (ssize_t)contents.size())
+            throw std::runtime_error("image: Truncated header.");
+
+        std::istringstream in(contents);
+        char magic[8];
+        if (!in.read(magic, sizeof(magic)) || memcmp(magic, "weasel04", sizeof(magic)))
+            throw std::runtime_error("image: Bad magic.");
+        m_code_size = get_imm<uint64_t>(in);
+        for (uint32_t n = get_imm<uint32_t>(in); n; --n) {
+            auto name = get_atom(in);
+            entry e{get_imm<uint64_t>(in), {}, {}, 0, {}};
+            for (uint32_t n = get_imm<uint32_t>(in); n; --n)
+                e.params.push_back(type(get_imm<uint8_t>(in)));
+            for (uint32_t n = get_imm<uint32_t>(in); n; --n)
+                e.resumes.push_back(get_imm<uint64_t>(in));
+            e.size = get_imm<uint64_t>(in);
+            for (uint32_t n = get_imm<uint32_t>(in); n; --n) {
+                span sp{get_imm<uint64_t>(in), get_imm<uint64_t>(in), {}};
+                for (uint32_t n = get_imm<uint32_t>(in); n; --n)
+                    sp.path.push_back(get_imm<uint32_t>(in));
+                e.spans.push_back(std::move(sp));
+            }
+            m_entries.emplace(std::move(name), std::move(e));
+        }
+        for (uint32_t n = get_imm<uint32_t>(in); n; --n)
+            m_symbols.push_back(get_atom(in));
+        for (uint32_t n = get_imm<uint32_t>(in); n; --n)
+            m_immediates.push_back(deserialize(in));
+        for (uint32_t n = get_imm<uint32_t>(in); n; --n) {
+            auto name = get_atom(in);
+            m_dispatches.emplace_back(std::move(name), get_imm<uint32_t>(in));
+        }
+
+        size_t header_size = in.tellg();
+        size_t code_offset = round(header_size + sizeof(uint64_t), pagesize());
+        if (code_offset + m_code_size > contents.size())
+            throw std::runtime_error("image: Truncated code.");
+        in.seekg(code_offset - sizeof(uint64_t));
+        if (get_imm<uint64_t>(in) != code_offset)
+            throw std::runtime_error("image: Bad header.");
+        map(nullptr, fd, code_offset);
+    }
+
+    image(const image &) = delete;
+    image &operator =(const image &) = delete;
+
+    ~image() {
+        if (m_buffer)
+            munmap(m_buffer, m_length);
+        if (m_fd != -1)
+            close(m_fd);
+    }
+
+    const char *code() const { return m_buffer; }
+    size_t code_size() const { return m_code_size; }
+    const std::vector<object> &immediates() const { return m_immediates; }
+    const std::map<std::string, entry> &entries() const { return m_entries; }
+    const std::vector<std::string> &symbols() const { return m_symbols; }
+    inline_cache *caches() const { return m_caches.get(); }
+    pool *workers() const { return m_workers; }
+
+    std::vector<cache_stats> stats() const {
+        std::vector<cache_stats> res;
+        for (size_t i = 0; i < m_dispatches.size(); ++i) {
+            res.push_back({m_caches[i].name, m_caches[i].hits.load(std::memory_order_relaxed),
+                           m_caches[i].misses.load(std::memory_order_relaxed)});
+        }
+        return res;
+    }
+
+    // The memfd backing a shared image, or -1.
+
+    int fd() const { return m_fd; }
+
+    static long pagesize() {
+        static const long pagesize = sysconf(_SC_PAGE_SIZE);
+        if (pagesize == -1)
+            throw std::runtime_error("Can't access page size.");
+        return pagesize;
+    }
+
+    static size_t round(size_t size, long pagesize) {
+        return (size + pagesize-1) / pagesize * pagesize;
+    }
+private:
+    // Lay out the code and call table. The code is either copied from memory
+    // or, when fd is valid, mapped directly from the memfd. Nothing is handed
+    // out unless every mapping and protection took, since code that is not
+    // executable would only fault on its first call.
+
+    void map(const char *code, int fd, size_t code_offset)
+    {
+        size_t code_length = round(m_code_size, pagesize());
+        size_t table_length = round(m_symbols.size() * sizeof(uintptr_t), pagesize());
+        size_t length = code_length + table_length;
+        std::vector<uintptr_t> addresses;
+        for (const auto &name : m_symbols)
+            addresses.push_back(resolve(name));
+        m_caches = std::make_unique<inline_cache[]>(m_dispatches.size());
+        for (size_t i = 0; i < m_dispatches.size(); ++i)
+            fill(m_caches[i], m_dispatches[i].first, m_dispatches[i].second);
+
+        void *buffer = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buffer == MAP_FAILED)
+            throw std::system_error(errno, std::generic_category(), "image: Cannot create image");
+        char *base = static_cast<char *>(buffer);
+        auto fail = [&](const char *what) {
+            int error = errno;
+            munmap(base, length);
+            throw std::system_error(error, std::generic_category(), what);
+        };
+
+        if (fd != -1) {
+            if (mmap(base, code_length, PROT_READ | PROT_EXEC, MAP_SHARED | MAP_FIXED,
+                     fd, code_offset) != base)
+                fail("image: Cannot map image");
+        }
+        else
+            memcpy(base, code, m_code_size);
+
+        if (!addresses.empty())
+            memcpy(base + code_length, addresses.data(), addresses.size() * sizeof(uintptr_t));
+
+        // Mark the code as executable and the call table as read only. This is
+        // required on modern hardware as anonymous memory is restricted from
+        // execution by default to prevent code injection attacks.
+
+        {
+            trace::scope timed{"mprotect"};
+            if (fd == -1 && mprotect(base, code_length, PROT_READ | PROT_EXEC) == -1)
+                fail("image: Cannot make code executable");
+            if (table_length && mprotect(base + code_length, table_length, PROT_READ) == -1)
+                fail("image: Cannot protect call table");
+        }
+        m_buffer = base;
+        m_length = length;
+    }
+
+    std::vector<object> m_immediates;
+    std::vector<std::string> m_symbols;
+    std::map<std::string, entry> m_entries;
+    std::vector<std::pair<std::string, size_t>> m_dispatches;
+    std::unique_ptr<inline_cache[]> m_caches;
+    pool *m_workers;
+    char *m_buffer = nullptr;
+    size_t m_length = 0;
+    size_t m_code_size = 0;
+    int m_fd = -1;
+};
+
+class native_function {
+public:
+    native_function(std::shared_ptr<const image> image, const entry &entry)
+    : m_image{std::move(image)}
+    , m_entry{&entry}
+    , m_code{m_image->code() + entry.offset} {}
+
+    // Evaluate the expression with the given arguments, returning its value.
+    // Asynchronous builtins are waited for on the calling thread.
+
+    object operator ()(std::vector<object> args = {}) const {
+        return invoke(std::move(args), nullptr);
+    }
+
+    // Evaluate the expression with its operand stack allocated from the given
+    // memory resource, which need not be thread safe, as forked subtrees use
+    // stacks of their own.
+
+    object operator ()(std::vector<object> args, std::pmr::memory_resource *resource) const {
+        return invoke(std::move(args), nullptr, resource);
+    }
+
+    // Evaluate the expression with at most the given amount of fuel, which is
+    // updated with what remains. Only code compiled with compile_options::metered
+    // consumes fuel, and returns nothing once it has run out.
+
+    std::optional<object> operator ()(std::vector<object> args, int64_t &fuel) const {
+        evaluation ev;
+        prepare(ev, std::move(args), nullptr);
+        ev.fuel = fuel;
+        object res = finish(ev);
+        fuel = ev.fuel;
+        if (fuel < 0)
+            return std::nullopt;
+        return res;
+    }
+
+    // Evaluate the expression with arguments that already have the types of
+    // its parameters, as when the caller has converted them once for many
+    // calls. They are checked but neither converted nor copied.
+
+    object apply(const std::vector<object> &args) const {
+        const auto &params = m_entry->params;
+        if (args.size() < params.size())
+            throw std::invalid_argument("native_function: Too few arguments.");
+        for (size_t i = 0; i < params.size(); ++i) {
+            if (params[i] != type::any && type_of(args[i]) != params[i])
+                throw std::invalid_argument("native_function: Argument of the wrong type.");
+        }
+        evaluation ev;
+        bind(ev, &args, nullptr);
+        return finish(ev);
+    }
+
+    // Start evaluating the expression on an event loop, which calls done with
+    // its value once every asynchronous builtin that it calls has completed,
+    // or with what it failed with, whether the code or a builtin threw. The
+    // evaluation is held on the loop until done has returned.
+
+    using completion = std::function<void(object, std::exception_ptr)>;
+
+    void start(event_loop &loop, std::vector<object> args, completion done) const {
+        auto ev = std::make_shared<evaluation>();
+        prepare(*ev, std::move(args), nullptr);
+        loop.hold();
+        loop.post([self = *this, ev, &loop, done = std::move(done)] {
+            self.step(loop, ev, done);
+        });
+    }
+
+    const std::vector<type> &params() const { return m_entry->params; }
+
+    // The inline caches of the image that the function belongs to.
+
+    std::vector<cache_stats> caches() const { return m_image->stats(); }
+
+    // The size of the code of the function, and the constant pool that it
+    // shares with the rest of its module.
+
+    size_t code_size() const { return m_entry->size; }
+    const std::vector<object> &immediates() const { return m_image->immediates(); }
+
+    // The ranges of code that evaluate each node of the expression, in the
+    // order that they were laid out. Offsets here and in the disassembly are
+    // from the start of the code of the image.
+
+    const std::vector<span> &source_map() const { return m_entry->spans; }
+
+    std::vector<instruction> disassemble() const {
+        size_t table = image::round(m_image->code_size(), image::pagesize());
+        return sexpr::disassemble(m_image->code(), m_entry->offset, m_entry->offset + m_entry->size,
+                                  table, m_image->symbols());
+    }
+
+    // Write a listing of the code, in which each range of instructions from
+    // the source map is headed by the node that it evaluates. Nodes are printed
+    // from the expression that was compiled when it is given, or else shown by
+    // their path.
+
+    std::ostream &dump(std::ostream &out, const list *source = nullptr) const {
+        out << "; " << code_size() << " bytes at 0x" << std::hex << m_entry->offset << std::dec
+            << ", " << immediates().size() << " immediates\n";
+        for (size_t i = 0; i < immediates().size(); ++i)
+            print(out << "; " << i << " = ", immediates()[i]) << "\n";
+
+        const auto &spans = source_map();
+        auto span = spans.begin();
+        for (const auto &ins : disassemble()) {
+            while (span != spans.end() && span->end <= ins.offset)
+                ++span;
+            if (span != spans.end() && span->begin == ins.offset)
+                node(out << "  ; ", *span, source) << "\n";
+            out << "  " << std::hex << std::setw(6) << std::setfill('0') << ins.offset
+                << std::dec << std::setfill(' ') << "  " << ins.text << "\n";
+        }
+        return out;
+    }
+private:
+    friend class adaptive_function;
+
+    static std::ostream &node(std::ostream &out, const span &span, const list *source) {
+        const object *obj = nullptr;
+        const list *li = source;
+        for (auto i : span.path) {
+            if (!li || i >= li->size()) {
+                li = source = nullptr;
                 break;
+            }
+            obj = &(*li)[i];
+            li = std::get_if<list>(obj);
+        }
+        if (source && obj)
+            return print(out, *obj);
+        if (source)
+            return print(out, *source);
+
+        out << "@";
+        for (size_t i = 0; i < span.path.size(); ++i)
+            out << (i ? "." : "") << span.path[i];
+        return out;
+    }
+
+    // The state of an invocation, which outlives its segments of code when
+    // they are run on an event loop.
+
+    struct evaluation {
+        explicit evaluation(std::pmr::memory_resource *resource = std::pmr::get_default_resource())
+        : stack{resource} {}
+
+        std::vector<object> args;
+        operand_stack stack;
+        std::vector<std::unique_ptr<fork_frame>> forks;
+        suspension suspended;
+        context ctx;
+        size_t segment = 0;
+        int64_t fuel = std::numeric_limits<int64_t>::max();
+        std::exception_ptr error;
+    };
+
+    void prepare(evaluation &ev, std::vector<object> args, call_site *sites) const {
+        const auto &params = m_entry->params;
+        if (args.size() < params.size())
+            throw std::invalid_argument("native_function: Too few arguments.");
+        for (size_t i = 0; i < params.size(); ++i)
+            coerce(args[i], params[i]);
+
+        ev.args = std::move(args);
+        bind(ev, &ev.args, sites);
+    }
+
+    void bind(evaluation &ev, const std::vector<object> *args, call_site *sites) const {
+        ev.ctx = context{&m_image->immediates(), args, sites, m_image->caches(), nullptr, nullptr, 0,
+                         m_image->code(), m_image->workers(), &ev.forks, &ev.suspended, &ev.fuel,
+                         &ev.error};
+    }
+
+    // Run the next segment of code, returning whether it was suspended on an
+    // asynchronous builtin rather than having finished the evaluation, and
+    // throwing what a helper failed with once the code has returned.
+
+    bool resume(evaluation &ev) const {
+        trace::scope timed{"invoke", "run"};
+        const char *code = ev.segment ? m_image->code() + m_entry->resumes[ev.segment-1] : m_code;
+        ++ev.segment;
+        (*reinterpret_cast<void (*)(operand_stack *, const context *)>(code))(&ev.stack, &ev.ctx);
+        if (ev.error) {
+            settle(ev.forks, ev.ctx.workers);
+            std::rethrow_exception(std::exchange(ev.error, nullptr));
+        }
+        return ev.suspended.fn;
+    }
+
+    object invoke(std::vector<object> args, call_site *sites,
+                  std::pmr::memory_resource *resource = std::pmr::get_default_resource()) const {
+        evaluation ev{resource};
+        prepare(ev, std::move(args), sites);
+        return finish(ev);
+    }
+
+    object finish(evaluation &ev) const {
+        while (resume(ev)) {
+            auto fn = std::exchange(ev.suspended.fn, nullptr);
+            ev.stack.push_back(await(fn, std::move(ev.suspended.operands)));
+        }
+        return ev.stack.empty() ? object{atom{}} : std::move(ev.stack.back());
+    }
+
+    // Run a segment on the loop, and have the completion of the builtin that
+    // it was suspended on post the next one. A builtin that throws rather than
+    // completing fails the evaluation, and must not call its completion.
+
+    void step(event_loop &loop, const std::shared_ptr<evaluation> &ev, const completion &done) const {
+        try {
+            if (resume(*ev)) {
+                auto fn = std::exchange(ev->suspended.fn, nullptr);
+                fn(std::move(ev->suspended.operands), [self = *this, ev, &loop, done](object obj) {
+                    loop.post([self, ev, &loop, done, obj = std::move(obj)]() mutable {
+                        ev->stack.push_back(std::move(obj));
+                        self.step(loop, ev, done);
+                    });
+                });
+                return;
+            }
+        }
+        catch (...) {
+            complete(loop, done, atom{}, std::current_exception());
+            return;
+        }
+        complete(loop, done, ev->stack.empty() ? object{atom{}} : std::move(ev->stack.back()), nullptr);
+    }
+
+    // Release the evaluation once done has returned, even if it throws.
+
+    static void complete(event_loop &loop, const completion &done, object value, std::exception_ptr error) {
+        struct held {
+            event_loop &loop;
+            ~held() { loop.release(); }
+        } scope{loop};
+        done(std::move(value), std::move(error));
+    }
+
+    std::shared_ptr<const image> m_image;
+    const entry *m_entry;
+    const char *m_code;
+};
+
+// A module holds the entry points of a set of named expressions that were
+// compiled together. All of them share one image, and with it a single
+// constant pool and call table.
+
+class module {
+public:
+    explicit module(std::shared_ptr<const image> image)
+    : m_image{std::move(image)} {}
+
+    native_function operator [](const std::string &name) const {
+        auto entry = entries().find(name);
+        if (entry == entries().end())
+            throw std::out_of_range("module: Unknown entry point.");
+        return native_function{m_image, entry->second};
+    }
+
+    // Offsets of each entry point from the start of the code, and the types of
+    // their parameters.
+
+    const std::map<std::string, entry> &entries() const { return m_image->entries(); }
+
+    size_t code_size() const { return m_image->code_size(); }
+    const std::vector<object> &immediates() const { return m_image->immediates(); }
+    std::vector<cache_stats> caches() const { return m_image->stats(); }
+
+    // The memfd to hand to load() in other processes, or -1 if the module was
+    // not compiled as shared.
+
+    int fd() const { return m_image->fd(); }
+private:
+    std::shared_ptr<const image> m_image;
+};
+
+// Options that change how compile() lays out its code.
+
+struct compile_options {
+    // Place the code in a memfd that other processes can map with load().
+    bool shared = false;
+
+    // Evaluate the arguments of a call in parallel on this pool when at least
+    // two of them are pure and cost at least fork_cost to evaluate, as
+    // estimated from the costs of the builtins that they call.
+    pool *parallel = nullptr;
+    unsigned fork_cost = 64;
+
+    // Charge the fuel of the invocation at every function entry and loop back
+    // edge, with the estimated cost of the code up to the next one, and bail
+    // out once it runs out.
+    bool metered = false;
+
+    // Allocate the scratch memory of the compiler from this resource, or from
+    // the default one. Nothing allocated from it outlives the call to compile(),
+    // as the image copies the code and keeps a constant pool of its own.
+    std::pmr::memory_resource *resource = nullptr;
+};
+
+namespace {
+// Code is laid out by copying stencils, which are short runs of machine code
+// with holes for a 32 bit immediate and the displacement of a call through the
+// call table, and patching the holes. Compiled code keeps the operand stack in
+// r13 and the context in r14, which are preserved across calls, so that a call
+// only needs to load its arguments from them.
+//
+// Every operation is a call to a builtin or a helper, except for arithmetic on
+// two numbers of the same type where inference has proven the types and the
+// builtin has not been replaced, which is done in place on the operand stack.
+
+struct stencil {
+    std::string_view code;
+    int imm;
+    int call;
+};
+
+// Save the registers that hold the operand stack and context, and one more so
+// that the stack stays aligned for calls, and set them from the arguments.
+
+constexpr stencil prologue = {
+    std::string_view("\x41\x54\x41\x55\x41\x56\x49\x89\xfd\x49\x89\xf6", 12), -1, -1
+};
+
+constexpr stencil epilogue = {
+    std::string_view("\x41\x5e\x41\x5d\x41\x5c\xc3", 7), -1, -1
+};
+
+// Call a helper with the operand stack, the context and an immediate.
+
+constexpr stencil helper = {
+    std::string_view("\x4c\x89\xef\x4c\x89\xf6\xba\0\0\0\0\xff\x15\0\0\0\0", 17), 7, 13
+};
+
+// Test the status returned by a helper that may fail, followed by a jump for
+// when it did.
+
+constexpr stencil check_status = {
+    std::string_view("\x84\xc0\x0f\x84\0\0\0\0", 8), -1, -1
+};
+
+// Load the arguments of %call, whose third is the address of a builtin from
+// the call table, which is what goes in the call hole.
+
+constexpr stencil call_args = {
+    std::string_view("\x4c\x89\xef\x4c\x89\xf6\x48\x8b\x15\0\0\0\0", 13), -1, 9
+};
+
+// Call a helper that is also handed the row number held in rbx.
+
+constexpr stencil row_helper = {
+    std::string_view("\x4c\x89\xef\x4c\x89\xf6\xba\0\0\0\0\x48\x89\xd9\xff\x15\0\0\0\0", 20), 7, 16
+};
+
+// Load the arguments of %await, whose fourth is an address from the call
+// table, which is what goes in the call hole.
+
+constexpr stencil await_args = {
+    std::string_view("\x4c\x89\xef\x4c\x89\xf6\xba\0\0\0\0\x48\x8b\x0d\0\0\0\0", 18), 7, 14
+};
+
+constexpr stencil call_table = {
+    std::string_view("\xff\x15\0\0\0\0", 6), -1, 2
+};
+
+// Add or multiply the two numbers on top of the operand stack into the lower
+// one and pop the other, which has nothing to destroy. The holes are patched
+// with the stack layout: where the end of the stack is kept, where the number
+// in the lower and in the top object is from the end, the lower once more, the
+// size of an object to move the end back by, and where the end is kept again.
+
+struct arithmetic_stencil {
+    std::string_view code;
+    int holes[6];
+};
+
+constexpr arithmetic_stencil add_int = {
+    std::string_view("\x49\x8b\x85\0\0\0\0\x48\x8b\x88\0\0\0\0\x48\x03\x88\0\0\0\0"
+                     "\x48\x89\x88\0\0\0\0\x48\x8d\x80\0\0\0\0\x49\x89\x85\0\0\0\0", 42),
+    { 3, 10, 17, 24, 31, 38 }
+};
+
+constexpr arithmetic_stencil mul_int = {
+    std::string_view("\x49\x8b\x85\0\0\0\0\x48\x8b\x88\0\0\0\0\x48\x0f\xaf\x88\0\0\0\0"
+                     "\x48\x89\x88\0\0\0\0\x48\x8d\x80\0\0\0\0\x49\x89\x85\0\0\0\0", 43),
+    { 3, 10, 18, 25, 32, 39 }
+};
+
+constexpr arithmetic_stencil add_real = {
+    std::string_view("\x49\x8b\x85\0\0\0\0\xf2\x0f\x10\x80\0\0\0\0\xf2\x0f\x58\x80\0\0\0\0"
+                     "\xf2\x0f\x11\x80\0\0\0\0\x48\x8d\x80\0\0\0\0\x49\x89\x85\0\0\0\0", 45),
+    { 3, 11, 19, 27, 34, 41 }
+};
+
+constexpr arithmetic_stencil mul_real = {
+    std::string_view("\x49\x8b\x85\0\0\0\0\xf2\x0f\x10\x80\0\0\0\0\xf2\x0f\x59\x80\0\0\0\0"
+                     "\xf2\x0f\x11\x80\0\0\0\0\x48\x8d\x80\0\0\0\0\x49\x89\x85\0\0\0\0", 45),
+    { 3, 11, 19, 27, 34, 41 }
+};
+
+// Where the operand stack keeps its end, how large an object is, and where a
+// number is kept within one. They are found by looking at an actual stack, and
+// arithmetic is called as usual if the end cannot be told apart.
+
+struct stack_layout {
+    bool known = false;
+    int32_t end = 0;
+    int32_t size = sizeof(object);
+    int32_t value = 0;
+};
+
+static const stack_layout &layout()
+{
+    static const stack_layout layout = [] {
+        stack_layout res;
+        operand_stack stack;
+        stack.reserve(4);
+        stack.push_back(integer(0));
+        stack.push_back(real(0));
+
+        auto base = [](const object &obj) { return reinterpret_cast<const char *>(&obj); };
+        res.value = int32_t(reinterpret_cast<const char *>(std::get_if<integer>(&stack[0])) - base(stack[0]));
+        bool same = reinterpret_cast<const char *>(std::get_if<real>(&stack[1])) - base(stack[1]) == res.value;
+
+        size_t found = 0;
+        for (size_t at = 0; at + sizeof(uintptr_t) <= sizeof(stack); at += sizeof(uintptr_t)) {
+            uintptr_t word;
+            memcpy(&word, reinterpret_cast<const char *>(&stack) + at, sizeof(word));
+            if (word == reinterpret_cast<uintptr_t>(stack.data() + stack.size())) {
+                res.end = int32_t(at);
+                ++found;
+            }
+        }
+        res.known = same && found == 1;
+        return res;
+    }();
+    return layout;
+}
+
+// Charge the fuel that the context points to by the immediate, followed by a
+// jump for when it runs out.
+
+constexpr stencil charge_fuel = {
+    std::string_view("\x49\x8b\x86\0\0\0\0\x48\x81\x28\0\0\0\0\x0f\x88\0\0\0\0", 20), 10, -1
+};
+
+// The assembler accumulates the code of every expression in a module along
+// with the constant pool and call table that they share.
+
+class assembler {
+public:
+    assembler(const compile_options &options = {})
+    : m_resource{options.resource ? options.resource : std::pmr::get_default_resource()}
+    , m_code{m_resource}
+    , m_constants{m_resource}
+    , m_numbers{m_resource}
+    , m_slots{m_resource}
+    , m_fixups{m_resource}
+    , m_deferred{m_resource}
+    , m_bails{m_resource}
+    , m_fork_cost{options.parallel ? options.fork_cost : 0}
+    , m_metered{options.metered} {}
+
+    // Emit the code for a single expression, returning its entry point.
+
+    entry emit(const list &root)
+    {
+        return emit(root, infer(root, signatures));
+    }
+
+    // Emit the code for an expression that has already been typed. Guarded
+    // calls and, when profiling, calls to generic implementations are made
+    // through helpers that are given the number of the call site.
+
+    entry emit(const list &root, typing types, bool profile = false)
+    {
+        trace::scope timed{"emit"};
+        size_t offset = here();
+        put(prologue);
+        metered([&] { body(root, types, profile); });
+        bail();
+        put(epilogue);
+
+        // The subtrees that were forked follow as functions of their own,
+        // which may fork in turn.
+
+        while (!m_deferred.empty()) {
+            auto [subtree, idx, k, path] = std::move(m_deferred.back());
+            m_deferred.pop_back();
+            std::get_if<list>(&m_immediates[idx])->at(k) = integer(here());
+            put(prologue);
+            metered([&] { body(*subtree, types, false, false, path); });
+            bail();
+            put(epilogue);
+        }
+        return entry{offset, std::move(types.params), std::move(m_resumes), here() - offset,
+                     std::move(m_spans)};
+    }
+
+    // Emit the code that evaluates an expression, leaving its value on the
+    // operand stack. The parameters of columnar code are columns of the batch
+    // in the context, which are read at the row number held in rbx.
+    //
+    // A call to an asynchronous builtin returns from the function once %await
+    // has moved its operands into the suspension, and the code after it is the
+    // entry point of the next segment. Nothing but the operand stack is live
+    // between calls, so it holds all the state that the segments share.
+    //
+    // The code for each node is added to the source map under its path, which
+    // for a subtree starts with the given prefix.
+
+    void body(const list &root, const typing &types, bool profile = false, bool columnar = false,
+              const std::vector<uint32_t> &prefix = {})
+    {
+        struct frame {
+            std::reference_wrapper<const list> parent;
+            list::const_iterator it;
+            std::vector<const list *> forked;
+        };
+        std::pmr::vector<struct frame> frames{m_resource};
+
+        // The path of the call on top of the frames, or of the operand that it
+        // is at.
+
+        auto path = [&](bool operand) {
+            std::vector<uint32_t> res = prefix;
+            for (size_t i = 0; i + 1 < frames.size() + operand; ++i)
+                res.push_back(frames[i].it - frames[i].parent.get().begin());
+            return res;
+        };
+        auto attribute = [&](size_t at, bool operand) {
+            m_spans.push_back({at, here(), path(operand)});
+        };
+
+        // Forked subtrees run on other threads, where neither the row of
+        // columnar code nor the call site numbering of guarded code hold.
+
+        std::map<const list *, std::pair<uint64_t, bool>> weights;
+        bool parallel = m_fork_cost && !profile && !columnar && types.guards.empty();
+        if (parallel)
+            weights = weigh(root, types);
+
+        auto enter = [&](const list &call) {
+            frames.push_back(frame{call, call.begin(), {}});
+            if (!parallel)
+                return;
+            auto &forked = frames.back().forked;
+            std::vector<uint32_t> children;
+            for (size_t i = 0; i < call.size(); ++i) {
+                auto *li = std::get_if<sexpr::list>(&call[i]);
+                if (!li || li->op.empty())
+                    continue;
+                auto [cost, pure] = weights.at(li);
+                if (pure && cost >= m_fork_cost) {
+                    forked.push_back(li);
+                    children.push_back(i);
+                }
+            }
+            if (forked.size() < 2) {
+                forked.clear();
+                return;
+            }
+            list offsets{"fork"};
+            offsets.resize(forked.size(), integer(0));
+            uint32_t idx = constant(offsets);
+            for (size_t k = 0; k < forked.size(); ++k) {
+                auto subtree = path(false);
+                subtree.push_back(children[k]);
+                m_deferred.push_back({forked[k], idx, (uint32_t)k, std::move(subtree)});
+            }
+            attribute(put(helper, idx, "%fork"), false);
+        };
+        enter(root);
+
+        uint32_t site = 0;
+        for (;;) {
+            if (frames.back().it == frames.back().parent.get().end()) {
+                const list &call = frames.back().parent.get();
+                const signature *sig = types.calls.at(&call);
+                bool generic = sig && std::count(sig->params.begin(), sig->params.end(), type::any);
+                size_t start = here();
+
+                if (!sig) {
+                    m_dispatches.emplace_back(call.op, call.size());
+                    put(helper, m_dispatches.size() - 1, "%dispatch");
+                    check();
+                }
+                else if (sig->async) {
+                    if (columnar)
+                        throw std::runtime_error("compile: Asynchronous call in a pipeline.");
+                    put(await_args, call.size(), sig->symbol);
+                    put(call_table, 0, "%await");
+                    put(epilogue);
+                    m_resumes.push_back(here());
+                    put(prologue);
+                }
+                else if (!types.guards.count(&call) && !(profile && generic) && native(*sig))
+                    arithmetic(*sig);
+                else {
+                    if (types.guards.count(&call))
+                        put(helper, site, "%guard");
+                    else if (profile && generic)
+                        put(helper, site, "%profile");
+                    else {
+                        put(call_args, 0, sig->symbol);
+                        put(call_table, 0, "%call");
+                    }
+                    check();
+                }
+                attribute(start, false);
+                m_spent += cost(call, sig);
+                ++site;
+
+                frames.pop_back();
+                if (frames.empty())
+                    break;
+                frames.back().it++;
+                continue;
+            }
+
+            auto *list = std::get_if<sexpr::list>(&*frames.back().it);
+            const auto &forked = frames.back().forked;
+            auto k = std::find(forked.begin(), forked.end(), list);
+            if (list && k != forked.end()) {
+                size_t at = put(helper, k - forked.begin(), "%join");
+                check();
+                attribute(at, true);
+                ++m_spent;
+                frames.back().it++;
+                continue;
+            }
+            if (list && !list->op.empty()) {
+                enter(*list);
+                continue;
+            }
+
+            // Parameters are fetched from the arguments of the invocation,
+            // while everything else is a constant.
+
+            uint32_t idx;
+            type ty;
+            auto *at = std::get_if<atom>(&*frames.back().it);
+            bool arg = at && parameter(*at, idx, ty);
+
+            size_t start = here();
+            if (arg && columnar)
+                put(row_helper, idx, "%push_col");
+            else if (arg)
+                put(helper, idx, "%push_arg");
+            else
+                put(helper, constant(*frames.back().it), "%push_imm");
+            attribute(start, true);
+            ++m_spent;
             frames.back().it++;
-            continue;
         }
-        
-        auto *list = std::get_if<sexpr::list>(&*frames.back().it);
-        if (list && !list->op.empty()) {
-            frames.push_back(frame{*list, list->begin()});
-            continue;
+    }
+
+    // Emit the code laid out by emit, preceded when metering by a charge for
+    // everything that it spent, which jumps past it when the fuel runs out.
+    // The stack must be as it was on entry where the code ends.
+
+    template <typename F>
+    void metered(F &&emit)
+    {
+        if (!m_metered) {
+            emit();
+            return;
+        }
+        size_t spent = m_spent;
+        size_t cost;
+        size_t exhausted = meter(cost);
+        emit();
+        charge(cost, m_spent - spent);
+        land(exhausted);
+    }
+
+    // Emit a charge of a cost to be patched with charge(), whose position is
+    // stored in cost, followed by a jump for when the fuel has run out, whose
+    // position is returned to hand to land(). The context must be in r14.
+
+    size_t meter(size_t &cost)
+    {
+        size_t at = put(charge_fuel);
+        patch(at + 3, offsetof(context, fuel));
+        cost = at + charge_fuel.imm;
+        return here() - sizeof(int32_t);
+    }
+
+    void charge(size_t at, uint64_t cost)
+    {
+        patch(at, (uint32_t)std::min<uint64_t>(cost, std::numeric_limits<int32_t>::max()));
+    }
+
+    // Whether a call is to the builtin arithmetic on two numbers of the same
+    // type, as long as it has not been replaced, and can be done inline.
+
+    static bool native(const signature &sig)
+    {
+        static const char *ops[] = { "+/int", "+/real", "*/int", "*/real" };
+        for (const char *op : ops) {
+            if (sig.symbol == op)
+                return layout().known && resolve(sig.symbol) == builtins.at(sig.symbol);
+        }
+        return false;
+    }
+
+    void arithmetic(const signature &sig)
+    {
+        const auto &l = layout();
+        bool floating = sig.symbol.back() == 'l';
+        const auto &s = sig.symbol[0] == '+' ? (floating ? add_real : add_int) : (floating ? mul_real : mul_int);
+        int32_t disps[] = { l.end, l.value - 2 * l.size, l.value - l.size, l.value - 2 * l.size, -l.size, l.end };
+        size_t at = here();
+        put(s.code);
+        for (size_t i = 0; i < std::size(disps); ++i)
+            patch(at + s.holes[i], uint32_t(disps[i]));
+    }
+
+    // Emit a check of the status that the helper just called returned, which
+    // jumps to the label placed by bail() when it failed.
+
+    void check()
+    {
+        put(check_status);
+        m_bails.push_back(here() - sizeof(int32_t));
+    }
+
+    // Place the label that every check since the last one jumps to, which
+    // must be where the function returns with the native stack as on entry.
+
+    void bail()
+    {
+        for (size_t at : m_bails)
+            land(at);
+        m_bails.clear();
+    }
+
+    // The estimated cost of all the code emitted so far.
+
+    uint64_t spent() const { return m_spent; }
+
+    // Copy a stencil, filling its immediate and pointing its call at the slot
+    // of the target. Returns where it was placed.
+
+    size_t put(const stencil &s, uint32_t imm = 0, const std::string &target = {})
+    {
+        size_t at = here();
+        m_code.append(s.code);
+        if (s.imm >= 0)
+            patch(at + s.imm, imm);
+        if (s.call >= 0)
+            m_fixups.emplace_back(at + s.call, slot(target));
+        return at;
+    }
+
+    // Primitives for code that is laid out by hand, such as loops.
+
+    void put(std::string_view code) { m_code.append(code); }
+    size_t here() const { return m_code.size(); }
+
+    void patch(size_t at, uint32_t val)
+    {
+        memcpy(&m_code[at], &val, sizeof(val));
+    }
+
+    // Emit a jump with a 32 bit displacement to a label that is yet to be
+    // placed, returning the position of the displacement to hand to land().
+
+    size_t jump(std::string_view op)
+    {
+        put(op);
+        size_t at = here();
+        m_code.append(sizeof(int32_t), '\0');
+        return at;
+    }
+
+    void land(size_t at)
+    {
+        patch(at, uint32_t(here() - (at + sizeof(int32_t))));
+    }
+
+    void jump_back(std::string_view op, size_t target)
+    {
+        put(op);
+        m_code.append(sizeof(int32_t), '\0');
+        patch(here() - sizeof(int32_t), uint32_t(target - here()));
+    }
+
+    // Allocate a slot in the call table for a target on first use.
+
+    uint32_t slot(const std::string &target)
+    {
+        auto slot = m_slots.find(target);
+        if (slot == m_slots.end()) {
+            slot = m_slots.emplace(target, m_table.size()).first;
+            m_table.push_back(target);
         }
-        
-        if (immediates.size() == std::numeric_limits<uint32_t>::max())
+        return slot->second;
+    }
+
+    // Resolve the call table references now that the size of the code is
+    // known, and hand everything over to a new image.
+
+    std::shared_ptr<const image> link(std::map<std::string, entry> &&entries,
+                                      const compile_options &options)
+    {
+        trace::scope timed{"link"};
+        size_t table = image::round(m_code.size(), image::pagesize());
+        for (auto [at, slot] : m_fixups) {
+            int64_t disp = table + slot * sizeof(uintptr_t) - (at + sizeof(int32_t));
+            if (disp > std::numeric_limits<int32_t>::max())
+                throw std::runtime_error("compile: Module too large.");
+            patch(at, (uint32_t)disp);
+        }
+        return std::make_shared<const image>(m_code, std::move(m_table), std::move(m_immediates),
+                                             std::move(entries), std::move(m_dispatches),
+                                             options.shared, options.parallel);
+    }
+private:
+    // Estimate the cost of evaluating every call of an expression, and whether
+    // it is pure, from the builtins that it calls. A call that is dispatched at
+    // runtime is taken to be as costly as its most costly implementation, and
+    // pure only if all of them are.
+
+    static std::map<const list *, std::pair<uint64_t, bool>> weigh(const list &root, const typing &types)
+    {
+        trace::scope timed{"weigh"};
+        std::map<const list *, std::pair<uint64_t, bool>> res;
+        std::vector<std::pair<const list *, bool>> todo = {{&root, false}};
+        while (!todo.empty()) {
+            auto [call, visited] = todo.back();
+            todo.pop_back();
+            if (!visited) {
+                todo.emplace_back(call, true);
+                for (const auto &child : *call) {
+                    auto *li = std::get_if<list>(&child);
+                    if (li && !li->op.empty())
+                        todo.emplace_back(li, false);
+                }
+                continue;
+            }
+
+            const signature *sig = types.calls.at(call);
+            uint64_t cost = assembler::cost(*call, sig);
+            bool pure = true;
+            if (sig)
+                pure = sig->pure;
+            else {
+                auto [first, last] = signatures.equal_range(call->op);
+                for (auto it = first; it != last; ++it) {
+                    if (it->second.params.size() == call->size())
+                        pure &= it->second.pure;
+                }
+            }
+            for (const auto &child : *call) {
+                auto *li = std::get_if<list>(&child);
+                if (li && !li->op.empty()) {
+                    cost += res.at(li).first;
+                    pure &= res.at(li).second;
+                }
+                else
+                    ++cost;
+            }
+            res.emplace(call, std::make_pair(cost, pure));
+        }
+        return res;
+    }
+
+    // The cost of a call itself, leaving out its operands.
+
+    static uint64_t cost(const list &call, const signature *sig)
+    {
+        if (sig)
+            return sig->cost;
+        uint64_t cost = 0;
+        auto [first, last] = signatures.equal_range(call.op);
+        for (auto it = first; it != last; ++it) {
+            if (it->second.params.size() == call.size())
+                cost = std::max<uint64_t>(cost, it->second.cost);
+        }
+        return cost;
+    }
+
+    struct deferred {
+        const list *subtree;
+        uint32_t idx;
+        uint32_t k;
+        std::vector<uint32_t> path;
+    };
+
+    // Add an object to the constant pool. Atoms that spell numbers are stored
+    // as their value, and equal strings and numbers are shared between all the
+    // expressions of the module. Numbers are told apart by their bits, so that
+    // the key is ordered even for reals that do not compare.
+
+    uint32_t constant(const object &obj)
+    {
+        auto *at = std::get_if<atom>(&obj);
+        object lit = at ? literal(*at) : object{atom{}};
+        const object &val = at ? lit : obj;
+
+        auto *str = std::get_if<atom>(&val);
+        if (str) {
+            auto found = m_constants.find(*str);
+            if (found != m_constants.end())
+                return found->second;
+        }
+        auto *in = std::get_if<integer>(&val);
+        auto *re = std::get_if<real>(&val);
+        std::pair<size_t, uint64_t> key{val.index(), 0};
+        if (in || re) {
+            memcpy(&key.second, in ? (const void *)in : (const void *)re, sizeof(key.second));
+            auto found = m_numbers.find(key);
+            if (found != m_numbers.end())
+                return found->second;
+        }
+
+        if (m_immediates.size() == std::numeric_limits<uint32_t>::max())
             throw std::runtime_error("compile: Too many immediates.");
-        immediates.push_back(*frames.back().it);
-        out << push_rdi;
-        out << push_rsi;
-        out << mov_rdx_imm32 << imm<uint32_t>{(uint32_t)immediates.size()-1};
-        out << mov_rax_imm64 << imm<uint64_t>{reinterpret_cast<uintptr_t>(&do_push_imm)};
-        out << call_rax;
-        out << pop_rsi;
-        out << pop_rdi;
-        frames.back().it++;
-    }
-    out << pop_rsi << ret;
-    out.flush();
-    
-    return native_function{out.str(), std::move(immediates)};
-}
-
-};
\ No newline at end of file
+        uint32_t idx = m_immediates.size();
+        if (str)
+            m_constants.emplace(*str, idx);
+        else if (in || re)
+            m_numbers.emplace(key, idx);
+        m_immediates.push_back(at ? std::move(lit) : obj);
+        return idx;
+    }
+
+    std::pmr::memory_resource *m_resource;
+    std::pmr::string m_code;
+    std::vector<object> m_immediates;
+    std::pmr::map<atom, uint32_t> m_constants;
+    std::pmr::map<std::pair<size_t, uint64_t>, uint32_t> m_numbers;
+    std::vector<std::string> m_table;
+    std::pmr::map<std::string, uint32_t> m_slots;
+    std::pmr::vector<std::pair<size_t, uint32_t>> m_fixups;
+    std::vector<std::pair<std::string, size_t>> m_dispatches;
+    std::pmr::vector<deferred> m_deferred;
+    std::pmr::vector<size_t> m_bails;
+    std::vector<size_t> m_resumes;
+    std::vector<span> m_spans;
+    uint64_t m_spent = 0;
+    unsigned m_fork_cost;
+    bool m_metered;
+};
+};
+
+// Register an implementation of a builtin for operands of the given types,
+// replacing any earlier one for the same types. Like the builtins above, it is
+// handed the operand stack and must replace its operands with the result. An
+// implementation whose parameters are all of type any is taken to handle every
+// type itself; otherwise calls whose operand types cannot be inferred are
+// dispatched at runtime through an inline cache. Implementations must be
+// registered before compiling code that calls them, and under the same name in
+// every process that loads a shared module. An implementation may throw, which
+// ends the evaluation and is rethrown to whoever started it.
+//
+// The cost is a rough estimate of how long a call takes relative to the
+// arithmetic builtins, and an implementation is pure if it has no effects other
+// than replacing its operands. Only pure subtrees are evaluated in parallel.
+
+namespace {
+static signature &declare(const std::string &name, const std::vector<type> &params, bool async)
+{
+    static const char *names[] = { "any", "int", "real", "str", "list" };
+
+    auto [first, last] = signatures.equal_range(name);
+    auto it = std::find_if(first, last, [&](const auto &sig) {
+        return sig.second.params == params;
+    });
+    const signature *same = it == last ? nullptr : &it->second;
+    bool overloaded = std::any_of(first, last, [&](const auto &sig) {
+        return (sig.second.async || async) && &sig.second != same;
+    });
+    if (overloaded || (it != last && it->second.async != async))
+        throw std::invalid_argument("define: Cannot overload an asynchronous builtin.");
+    if (it == last) {
+        std::string symbol = name + "/";
+        for (size_t i = 0; i < params.size(); ++i)
+            symbol += (i ? "," : "") + std::string(names[int(params[i])]);
+        it = signatures.emplace(name, signature{symbol, params, type::any});
+    }
+    return it->second;
+}
+};
+
+void define(const std::string &name, const std::vector<type> &params, type result,
+            void (*fn)(operand_stack *), unsigned cost = 1, bool pure = true)
+{
+    auto &sig = declare(name, params, false);
+    sig.result = result;
+    sig.cost = cost;
+    sig.pure = pure;
+    symbols()[sig.symbol] = reinterpret_cast<uintptr_t>(fn);
+}
+
+// Register an asynchronous builtin that takes the given number of operands of
+// any type. Since the evaluation is suspended at every call, such builtins are
+// never evaluated in parallel or overloaded, and cannot be called by
+// pipelines. An implementation that throws fails the evaluation, and must then
+// not call done.
+
+void define(const std::string &name, size_t arity, type result, async_builtin fn)
+{
+    auto &sig = declare(name, std::vector<type>(arity, type::any), true);
+    sig.result = result;
+    sig.pure = false;
+    sig.async = true;
+    symbols()[sig.symbol] = reinterpret_cast<uintptr_t>(fn);
+}
+
+// Compile a set of named expressions into a single module. The code is laid
+// out in the order given, so expressions that are evaluated together should be
+// kept next to each other.
+
+module compile(const std::vector<std::pair<std::string, list>> &exprs,
+               const compile_options &options = {})
+{
+    assembler as{options};
+    std::map<std::string, entry> entries;
+    for (const auto &[name, root] : exprs) {
+        if (entries.count(name))
+            throw std::runtime_error("compile: Duplicate entry point.");
+        entries.emplace(name, as.emit(root));
+    }
+    return module{as.link(std::move(entries), options)};
+}
+
+native_function compile(const list &root, const compile_options &options = {})
+{
+    assembler as{options};
+    auto image = as.link({{"", as.emit(root)}}, options);
+    return native_function{image, image->entries().at("")};
+}
+
+// Map a module that another process compiled with compile_options::shared. The
+// descriptor may be closed once this returns. Forked subtrees are evaluated on
+// the given pool, or one after the other without one.
+
+module load(int fd, pool *workers = nullptr)
+{
+    return module{std::make_shared<const image>(fd, workers)};
+}
+
+};
@@ -0,0 +1,144 @@
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#pragma once
+
+namespace sexpr {
+
+// A decoded instruction. Offsets, including those of jump targets, are from the
+// start of the code of the image.
+
+struct instruction {
+    size_t offset;
+    size_t length;
+    std::string text;
+};
+
+namespace {
+// The forms of the instructions that the assembler and pipeline compiler emit,
+// which is all that the disassembler knows about. Each is an opcode followed
+// by at most one operand of 32 bits, and then by the rest of the text.
+
+enum class operand { none, imm, rel, rip, disp };
+
+struct form {
+    std::string_view code;
+    const char *text;
+    operand op;
+    const char *rest = "";
+};
+
+constexpr form forms[] = {
+    { "\x53",         "push rbx",          operand::none },
+    { "\x41\x54",     "push r12",          operand::none },
+    { "\x41\x55",     "push r13",          operand::none },
+    { "\x41\x56",     "push r14",          operand::none },
+    { "\x41\x57",     "push r15",          operand::none },
+    { "\x5b",         "pop rbx",           operand::none },
+    { "\x41\x5c",     "pop r12",           operand::none },
+    { "\x41\x5d",     "pop r13",           operand::none },
+    { "\x41\x5e",     "pop r14",           operand::none },
+    { "\x41\x5f",     "pop r15",           operand::none },
+    { "\xc3",         "ret",               operand::none },
+    { "\x49\x89\xfd", "mov r13, rdi",      operand::none },
+    { "\x49\x89\xf6", "mov r14, rsi",      operand::none },
+    { "\x4c\x89\xef", "mov rdi, r13",      operand::none },
+    { "\x4c\x89\xf6", "mov rsi, r14",      operand::none },
+    { "\x48\x89\xd9", "mov rcx, rbx",      operand::none },
+    { "\x48\x89\xda", "mov rdx, rbx",      operand::none },
+    { "\x31\xdb",     "xor ebx, ebx",      operand::none },
+    { "\x4c\x39\xe3", "cmp rbx, r12",      operand::none },
+    { "\x84\xc0",     "test al, al",       operand::none },
+    { "\x48\xff\xc3", "inc rbx",           operand::none },
+    { "\xba",         "mov edx, ",         operand::imm },
+    { "\x48\x81\x28", "sub qword [rax], ", operand::imm },
+    { "\x49\x8b\x86", "mov rax, [r14",     operand::disp },
+    { "\x4d\x8b\xa6", "mov r12, [r14",     operand::disp },
+    { "\x49\x8b\x85", "mov rax, [r13",     operand::disp },
+    { "\x49\x89\x85", "mov [r13",          operand::disp, ", rax" },
+    { "\x48\x8b\x88", "mov rcx, [rax",     operand::disp },
+    { "\x48\x89\x88", "mov [rax",          operand::disp, ", rcx" },
+    { "\x48\x03\x88", "add rcx, [rax",     operand::disp },
+    { "\x48\x0f\xaf\x88", "imul rcx, [rax", operand::disp },
+    { "\x48\x8d\x80", "lea rax, [rax",     operand::disp },
+    { "\xf2\x0f\x10\x80", "movsd xmm0, [rax", operand::disp },
+    { "\xf2\x0f\x11\x80", "movsd [rax",   operand::disp, ", xmm0" },
+    { "\xf2\x0f\x58\x80", "addsd xmm0, [rax", operand::disp },
+    { "\xf2\x0f\x59\x80", "mulsd xmm0, [rax", operand::disp },
+    { "\xff\x15",     "call ",             operand::rip },
+    { "\x48\x8b\x0d", "mov rcx, ",         operand::rip },
+    { "\x48\x8b\x15", "mov rdx, ",         operand::rip },
+    { "\x0f\x83",     "jae ",              operand::rel },
+    { "\x0f\x84",     "jz ",               operand::rel },
+    { "\x0f\x88",     "js ",               operand::rel },
+    { "\xe9",         "jmp ",              operand::rel },
+};
+};
+
+// Decode the code between two offsets. References to the call table, which
+// starts at the given offset, are shown as the names of their symbols, and
+// bytes that are not the start of a known instruction are shown as such.
+
+std::vector<instruction> disassemble(const char *code, size_t begin, size_t end, size_t table,
+                                     const std::vector<std::string> &symbols)
+{
+    std::vector<instruction> res;
+    for (size_t at = begin; at < end; ) {
+        const form *match = nullptr;
+        for (const auto &form : forms) {
+            size_t length = form.code.size() + (form.op == operand::none ? 0 : sizeof(int32_t));
+            if (at + length <= end && std::string_view(code + at, form.code.size()) == form.code) {
+                match = &form;
+                break;
+            }
+        }
+
+        std::ostringstream text;
+        if (!match) {
+            text << ".byte 0x" << std::hex << std::setw(2) << std::setfill('0')
+                 << (unsigned)(uint8_t)code[at];
+            res.push_back({at, 1, text.str()});
+            ++at;
+            continue;
+        }
+
+        size_t length = match->code.size();
+        text << match->text;
+        if (match->op != operand::none) {
+            int32_t val;
+            memcpy(&val, code + at + length, sizeof(val));
+            length += sizeof(val);
+            int64_t target = int64_t(at + length) + val;
+            size_t slot = (target - int64_t(table)) / sizeof(uintptr_t);
+
+            switch (match->op) {
+            case operand::imm:
+                text << (uint32_t)val;
+                break;
+            case operand::disp:
+                text << (val < 0 ? "-" : "+") << "0x" << std::hex << (val < 0 ? -int64_t(val) : val) << "]";
+                break;
+            case operand::rel:
+                text << "0x" << std::hex << target;
+                break;
+            default:
+                if (target >= int64_t(table) && slot < symbols.size())
+                    text << "[" << symbols[slot] << "]";
+                else
+                    text << "[0x" << std::hex << target << "]";
+                break;
+            }
+        }
+        text << match->rest;
+        res.push_back({at, length, text.str()});
+        at += length;
+    }
+    return res;
+}
+
+};
@@ -0,0 +1,343 @@
+#include "stream.h"
+#include <algorithm>
+#include <charconv>
+#include <map>
+#include <stdexcept>
+
+#pragma once
+
+namespace sexpr {
+
+// The types that the compiler is able to tell apart. A value of type any may
+// hold anything at runtime, and must be checked by whoever consumes it.
+
+enum class type : uint8_t { any, integer, real, string, list };
+
+// Classify an atom by the literal that it spells. Only unquoted atoms that are
+// entirely a decimal number are numbers; everything else is a string.
+
+type classify(const atom &at)
+{
+    object val = integer(0);
+    if (at.quoted || !number(at, &val))
+        return type::string;
+    return std::holds_alternative<integer>(val) ? type::integer : type::real;
+}
+
+// Convert an atom to the value of the literal that it spells.
+
+object literal(const atom &at)
+{
+    object res = at;
+    number(res);
+    return res;
+}
+
+type type_of(const object &obj)
+{
+    if (std::holds_alternative<list>(obj))
+        return type::list;
+    if (std::holds_alternative<integer>(obj))
+        return type::integer;
+    if (std::holds_alternative<real>(obj))
+        return type::real;
+    return type::string;
+}
+
+// Parameters are written as $N, where N is the index of the argument, and may
+// be annotated with their type as in $0:int. Returns false for other atoms,
+// and for string literals, which are never parameters.
+
+bool parameter(const atom &at, uint32_t &idx, type &ty)
+{
+    if (at.quoted || at.size() < 2 || at[0] != '$')
+        return false;
+
+    const char *end = at.data() + at.size();
+    auto res = std::from_chars(at.data() + 1, end, idx);
+    if (res.ec != std::errc{} || res.ptr == at.data() + 1)
+        return false;
+    if (res.ptr == end) {
+        ty = type::any;
+        return true;
+    }
+
+    static const std::map<std::string, type> names = {
+        { "int",  type::integer },
+        { "real", type::real },
+        { "str",  type::string },
+        { "list", type::list }
+    };
+    if (*res.ptr != ':')
+        return false;
+    auto name = names.find(std::string(res.ptr + 1, end));
+    if (name == names.end())
+        throw std::runtime_error("infer: Unknown type annotation.");
+    ty = name->second;
+    return true;
+}
+
+// A signature describes one implementation of a builtin. Parameters of type any
+// accept every value, so an implementation with only such parameters is the
+// generic fallback that checks its operands at runtime. The cost is a rough
+// measure of how long a call takes, and a pure implementation has no effects
+// other than computing its result. An asynchronous implementation suspends the
+// evaluation until its result arrives.
+
+struct signature {
+    std::string symbol;
+    std::vector<type> params;
+    type result;
+    unsigned cost = 1;
+    bool pure = true;
+    bool async = false;
+};
+
+// A call whose implementation was chosen on the strength of type feedback
+// rather than proof. The operands with an expected type other than any must be
+// checked before each call, falling back to the implementation that would have
+// been chosen without the feedback when they do not match.
+
+struct guard {
+    std::vector<type> expect;
+    const signature *fallback;
+};
+
+// The result of inference: the implementation chosen for every call site, and
+// the types of the parameters as given by their annotations. Call sites are
+// numbered in the order that they are evaluated. The implementation is null
+// for calls that must be dispatched on the operand types at runtime.
+
+struct typing {
+    std::map<const list *, const signature *> calls;
+    std::map<const list *, guard> guards;
+    std::vector<const list *> sites;
+    std::vector<type> params;
+    type result;
+};
+
+namespace {
+// Choose the most specific implementation that accepts the argument types. Any
+// argument whose type is not known can only be passed to a generic parameter.
+// Returns null when there is no such implementation.
+
+static const signature *best(const std::multimap<std::string, signature> &builtins,
+                             const std::string &name, const std::vector<type> &args)
+{
+    auto [first, last] = builtins.equal_range(name);
+    if (first == last)
+        throw std::runtime_error("compile: Unknown function.");
+
+    const signature *best = nullptr;
+    size_t best_generic = 0;
+    bool arity = false;
+    for (auto it = first; it != last; ++it) {
+        const auto &params = it->second.params;
+        if (params.size() != args.size())
+            continue;
+        arity = true;
+
+        size_t generic = 0;
+        bool match = true;
+        for (size_t i = 0; i < args.size() && match; ++i) {
+            if (params[i] == type::any)
+                ++generic;
+            else
+                match = params[i] == args[i];
+        }
+        if (match && (!best || generic < best_generic)) {
+            best = &it->second;
+            best_generic = generic;
+        }
+    }
+    if (!arity)
+        throw std::runtime_error("compile: Wrong number of arguments.");
+    return best;
+}
+
+static const signature *resolve(const std::multimap<std::string, signature> &builtins,
+                                const std::string &name, const std::vector<type> &args)
+{
+    const signature *sig = best(builtins, name, args);
+    if (!sig)
+        throw std::runtime_error("compile: No matching implementation.");
+    return sig;
+}
+
+// A builtin that has no implementation accepting operands of any type must be
+// dispatched at runtime when the type of an operand is unknown, unless a single
+// implementation accepts them anyway. Returns whether that is the case, along
+// with the result type shared by all the implementations that could be chosen.
+
+static bool dispatched(const std::multimap<std::string, signature> &builtins,
+                       const std::string &name, const std::vector<type> &args, type &result)
+{
+    if (std::find(args.begin(), args.end(), type::any) == args.end())
+        return false;
+    if (best(builtins, name, args))
+        return false;
+
+    size_t candidates = 0;
+    auto [first, last] = builtins.equal_range(name);
+    for (auto it = first; it != last; ++it) {
+        const auto &params = it->second.params;
+        if (params.size() != args.size())
+            continue;
+        bool match = true;
+        for (size_t i = 0; i < args.size() && match; ++i)
+            match = params[i] == type::any || args[i] == type::any || params[i] == args[i];
+        if (!match)
+            continue;
+        result = candidates++ && result != it->second.result ? type::any : it->second.result;
+    }
+    if (!candidates)
+        throw std::runtime_error("compile: No matching implementation.");
+    return true;
+}
+};
+
+// Collect the types of the parameters of an expression. An annotation applies
+// to every use of the parameter, so that it only needs to be written once.
+
+std::vector<type> params(const list &root)
+{
+    std::vector<type> res;
+    std::vector<std::pair<const list *, size_t>> todo = {{&root, 0}};
+    while (!todo.empty()) {
+        auto &[parent, i] = todo.back();
+        if (i == parent->size()) {
+            todo.pop_back();
+            continue;
+        }
+        const object &obj = (*parent)[i++];
+        if (auto *li = std::get_if<list>(&obj)) {
+            if (!li->op.empty())
+                todo.emplace_back(li, 0);
+            continue;
+        }
+
+        uint32_t idx;
+        type ty;
+        auto *at = std::get_if<atom>(&obj);
+        if (!at || !parameter(*at, idx, ty))
+            continue;
+        if (res.size() <= idx)
+            res.resize(idx + 1, type::any);
+        if (ty != type::any) {
+            if (res[idx] != type::any && res[idx] != ty)
+                throw std::runtime_error("infer: Conflicting type annotations.");
+            res[idx] = ty;
+        }
+    }
+    return res;
+}
+
+// Infer the type of every node of an expression bottom up, from the literals
+// and parameter annotations at its leaves and the signatures of the builtins.
+//
+// The schema, when given, holds the types of the parameters where they are known
+// from elsewhere, such as from the columns of a batch.
+//
+// Speculation, when given, holds for each call site the only type that each of
+// its operands has been seen with, or any. Operands that cannot be proven are
+// then assumed to be of that type, and the call guarded. Since a guard that
+// fails falls back to a generic implementation, everything computed from the
+// result of a guarded call is itself speculative and must be guarded in turn.
+
+typing infer(const list &root, const std::multimap<std::string, signature> &builtins,
+             const std::vector<std::vector<type>> *speculation = nullptr,
+             const std::vector<type> *schema = nullptr)
+{
+    trace::scope timed{"infer"};
+    struct frame {
+        std::reference_wrapper<const list> parent;
+        list::const_iterator it;
+        std::vector<type> args;
+        std::vector<bool> speculative;
+    };
+    std::vector<struct frame> frames = {{root, root.begin(), {}, {}}};
+
+    typing res;
+    res.params = params(root);
+    for (size_t i = 0; schema && i < std::min(schema->size(), res.params.size()); ++i) {
+        if (res.params[i] == type::any)
+            res.params[i] = (*schema)[i];
+        else if ((*schema)[i] != type::any && (*schema)[i] != res.params[i])
+            throw std::runtime_error("infer: Conflicting type annotations.");
+    }
+    for (;;) {
+        auto &top = frames.back();
+        if (top.it == top.parent.get().end()) {
+            const auto &call = top.parent.get();
+            size_t site = res.sites.size();
+            res.sites.push_back(&call);
+
+            // Calls that are dispatched at runtime adapt to the operand types
+            // by themselves, so are never speculated on.
+
+            std::vector<type> proven = top.args;
+            for (size_t i = 0; i < proven.size(); ++i) {
+                if (top.speculative[i])
+                    proven[i] = type::any;
+            }
+
+            type result;
+            const signature *sig = nullptr;
+            bool speculate = false;
+            if (!dispatched(builtins, call.op, proven, result)) {
+                std::vector<type> expect(top.args.size(), type::any);
+                for (size_t i = 0; i < top.args.size(); ++i) {
+                    if (top.speculative[i])
+                        expect[i] = top.args[i];
+                    else if (top.args[i] == type::any && speculation && site < speculation->size()
+                             && i < (*speculation)[site].size())
+                        expect[i] = top.args[i] = (*speculation)[site][i];
+                    speculate |= expect[i] != type::any;
+                }
+
+                sig = best(builtins, call.op, top.args);
+                const signature *fallback = resolve(builtins, call.op, proven);
+                if (!sig || sig == fallback) {
+                    sig = fallback;
+                    speculate = false;
+                }
+                else if (speculate)
+                    res.guards.emplace(&call, guard{std::move(expect), fallback});
+                result = sig->result;
+            }
+            res.calls.emplace(&call, sig);
+
+            frames.pop_back();
+            if (frames.empty()) {
+                res.result = speculate ? type::any : result;
+                break;
+            }
+            frames.back().args.push_back(result);
+            frames.back().speculative.push_back(speculate);
+            frames.back().it++;
+            continue;
+        }
+
+        auto *list = std::get_if<sexpr::list>(&*top.it);
+        if (list && !list->op.empty()) {
+            frames.push_back(frame{*list, list->begin(), {}, {}});
+            continue;
+        }
+
+        uint32_t idx;
+        type ty;
+        auto *at = std::get_if<atom>(&*top.it);
+        if (at && parameter(*at, idx, ty))
+            ty = res.params[idx];
+        else if (at)
+            ty = classify(*at);
+        else
+            ty = type_of(*top.it);
+        top.args.push_back(ty);
+        top.speculative.push_back(false);
+        top.it++;
+    }
+    return res;
+}
+
+};
@@ -0,0 +1,70 @@
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+
+#pragma once
+
+namespace sexpr {
+
+// An event loop runs the steps of evaluations that suspend on asynchronous
+// builtins. Steps may be posted from any thread, typically by the service that
+// completes a request, and are run by whichever threads are inside run(), so
+// that a few threads can drive any number of evaluations in flight.
+
+class event_loop {
+public:
+    event_loop() = default;
+    event_loop(const event_loop &) = delete;
+    event_loop &operator =(const event_loop &) = delete;
+
+    void post(std::function<void()> fn) {
+        std::lock_guard<std::mutex> lock{m_lock};
+        m_queue.push_back(std::move(fn));
+        m_wake.notify_one();
+    }
+
+    // Count an operation in flight, for run() to wait for until it is
+    // released, even while nothing is queued.
+
+    void hold() {
+        std::lock_guard<std::mutex> lock{m_lock};
+        ++m_held;
+    }
+
+    void release() {
+        std::lock_guard<std::mutex> lock{m_lock};
+        --m_held;
+        m_wake.notify_all();
+    }
+
+    // Run queued steps until nothing is queued or held. A step that throws
+    // ends the call with its exception, leaving the rest queued for the next.
+
+    void run() {
+        for (;;) {
+            std::function<void()> fn;
+            {
+                std::unique_lock<std::mutex> lock{m_lock};
+                m_wake.wait(lock, [this] { return !m_queue.empty() || !m_held; });
+                if (m_queue.empty())
+                    return;
+                fn = std::move(m_queue.front());
+                m_queue.pop_front();
+            }
+            fn();
+        }
+    }
+
+    size_t held() const {
+        std::lock_guard<std::mutex> lock{m_lock};
+        return m_held;
+    }
+private:
+    mutable std::mutex m_lock;
+    std::condition_variable m_wake;
+    std::deque<std::function<void()>> m_queue;
+    size_t m_held = 0;
+};
+
+};
@@ -0,0 +1,250 @@
+#include "compile.h"
+#include "pipeline.h"
+#include <algorithm>
+#include <map>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#pragma once
+
+namespace sexpr {
+
+// A discrimination network matches many boolean rules against each event, the
+// arguments of which are the parameters of every rule. A rule whose operator is
+// and is the conjunction of its operands, which may be further conjunctions,
+// and any other rule is a single test. Pure tests that are spelled the same
+// are shared between all the rules that make them, so that each is evaluated
+// at most once per event however many rules it appears in, and all the tests
+// are compiled together into one module. A test with effects belongs to its
+// rule alone, and is evaluated in the order of the rule once every operand
+// before it has passed, so that earlier operands may guard it.
+
+class network {
+public:
+    explicit network(const std::vector<list> &rules, const compile_options &options = {})
+    : m_rules(rules.size())
+    {
+        trace::scope timed{"network"};
+        std::map<std::string, uint32_t> known;
+        std::vector<std::pair<std::string, list>> exprs;
+
+        for (uint32_t r = 0; r < rules.size(); ++r) {
+            object whole = rules[r];
+            std::vector<const object *> todo = {&whole};
+            auto &rule = m_rules[r];
+
+            while (!todo.empty()) {
+                const object *obj = todo.back();
+                todo.pop_back();
+                auto *li = std::get_if<list>(obj);
+                if (li && li->op == "and") {
+                    for (auto it = li->rbegin(); it != li->rend(); ++it)
+                        todo.push_back(&*it);
+                    continue;
+                }
+
+                // Constants, quoted lists included, are decided once here, and
+                // nothing after one that is false is ever evaluated. Parameters
+                // are tested directly rather than through compiled code.
+
+                uint32_t idx;
+                type ty;
+                auto *at = std::get_if<atom>(obj);
+                bool param = at && parameter(*at, idx, ty);
+                if (!param && !(li && !li->op.empty())) {
+                    if (!truthy(at ? literal(*at) : *obj)) {
+                        rule.never = true;
+                        break;
+                    }
+                    continue;
+                }
+
+                bool shared = param || pure(*li);
+                uint32_t t = uint32_t(m_tests.size());
+                if (shared) {
+                    std::ostringstream text;
+                    print(text, *obj);
+                    t = known.emplace(text.str(), t).first->second;
+                }
+                if (t == m_tests.size()) {
+                    m_tests.emplace_back();
+                    m_tests.back().pure = shared;
+                    if (param)
+                        m_tests.back().param = idx;
+                    else
+                        exprs.emplace_back(std::to_string(t), *li);
+                }
+                if (!shared || std::find(rule.tests.begin(), rule.tests.end(), t) == rule.tests.end()) {
+                    rule.tests.push_back(t);
+                    m_tests[t].rules.push_back(r);
+                }
+                rule.ordered |= !shared;
+            }
+        }
+
+        // Tests whose parameters have the same types share the conversion of
+        // the event to them.
+
+        if (!exprs.empty()) {
+            module mod = compile(exprs, options);
+            std::map<std::vector<type>, uint32_t> groups;
+            for (uint32_t t = 0; t < m_tests.size(); ++t) {
+                auto &test = m_tests[t];
+                if (test.param >= 0)
+                    continue;
+                test.function = mod[std::to_string(t)];
+                auto [found, fresh] = groups.emplace(test.function->params(), uint32_t(m_groups.size()));
+                if (fresh)
+                    m_groups.push_back(found->first);
+                test.group = found->second;
+            }
+        }
+
+        // Pure tests shared by the most rules are evaluated first, since each
+        // that fails rules out the most others.
+
+        for (uint32_t t = 0; t < m_tests.size(); ++t) {
+            if (m_tests[t].pure)
+                m_order.push_back(t);
+        }
+        std::stable_sort(m_order.begin(), m_order.end(), [&](uint32_t a, uint32_t b) {
+            return m_tests[a].rules.size() > m_tests[b].rules.size();
+        });
+    }
+
+    // The indices of the rules that match an event, in ascending order. Pure
+    // tests are skipped once every rule that makes them has been ruled out,
+    // and rules with tests that have effects are then walked in order. The
+    // event is converted to the types of the parameters of a group of tests
+    // when the first of them is evaluated, and only copied if it has to be.
+
+    std::vector<size_t> match(const std::vector<object> &args) const
+    {
+        std::vector<bool> failed(m_rules.size());
+        for (uint32_t r = 0; r < m_rules.size(); ++r)
+            failed[r] = m_rules[r].never;
+
+        std::vector<std::vector<object>> converted(m_groups.size());
+        std::vector<const std::vector<object> *> events(m_groups.size());
+        std::vector<int8_t> passed(m_tests.size(), -1);
+
+        auto evaluate = [&](uint32_t t) {
+            const auto &test = m_tests[t];
+            if (test.pure && passed[t] >= 0)
+                return bool(passed[t]);
+            bool pass;
+            if (test.param >= 0) {
+                if (size_t(test.param) >= args.size())
+                    throw std::invalid_argument("network: Too few arguments.");
+                pass = truthy(args[test.param]);
+            }
+            else {
+                auto &event = events[test.group];
+                if (!event)
+                    event = convert(args, m_groups[test.group], converted[test.group]);
+                pass = truthy(test.function->apply(*event));
+            }
+            passed[t] = pass;
+            return pass;
+        };
+
+        for (uint32_t t : m_order) {
+            const auto &test = m_tests[t];
+            if (std::all_of(test.rules.begin(), test.rules.end(), [&](uint32_t r) { return failed[r]; }))
+                continue;
+            if (!evaluate(t))
+                for (uint32_t r : test.rules)
+                    failed[r] = true;
+        }
+
+        // A pure test that failed does not stop the tests with effects before
+        // it in its rule, which would have been evaluated first.
+
+        for (uint32_t r = 0; r < m_rules.size(); ++r) {
+            const auto &rule = m_rules[r];
+            if (!rule.ordered)
+                continue;
+            bool pass = std::all_of(rule.tests.begin(), rule.tests.end(), evaluate);
+            failed[r] = rule.never || !pass;
+        }
+
+        std::vector<size_t> res;
+        for (size_t r = 0; r < m_rules.size(); ++r)
+            if (!failed[r])
+                res.push_back(r);
+        return res;
+    }
+
+    // The number of distinct tests that the rules were reduced to.
+
+    size_t tests() const { return m_tests.size(); }
+
+private:
+    struct test {
+        int64_t param = -1;
+        std::optional<native_function> function;
+        uint32_t group = 0;
+        std::vector<uint32_t> rules;
+        bool pure = true;
+    };
+
+    // The tests of a rule in the order that they are made, and whether any of
+    // them has effects, so that they must be evaluated in that order.
+
+    struct rule {
+        std::vector<uint32_t> tests;
+        bool never = false;
+        bool ordered = false;
+    };
+
+    // Whether a test has no effects, whichever implementations of the
+    // builtins that it calls are chosen for it.
+
+    static bool pure(const list &expr)
+    {
+        std::vector<const list *> todo = {&expr};
+        while (!todo.empty()) {
+            const list *call = todo.back();
+            todo.pop_back();
+            auto [first, last] = signatures.equal_range(call->op);
+            for (auto it = first; it != last; ++it) {
+                if (it->second.params.size() == call->size() && !it->second.pure)
+                    return false;
+            }
+            for (const auto &child : *call) {
+                auto *li = std::get_if<list>(&child);
+                if (li && !li->op.empty())
+                    todo.push_back(li);
+            }
+        }
+        return true;
+    }
+
+    // The event itself if it already has the given types, or else a copy of it
+    // converted to them as an invocation would.
+
+    static const std::vector<object> *convert(const std::vector<object> &args,
+                                              const std::vector<type> &params, std::vector<object> &copy)
+    {
+        if (args.size() < params.size())
+            throw std::invalid_argument("network: Too few arguments.");
+        bool same = true;
+        for (size_t i = 0; i < params.size(); ++i)
+            same &= params[i] == type::any || type_of(args[i]) == params[i];
+        if (same)
+            return &args;
+        copy = args;
+        for (size_t i = 0; i < params.size(); ++i)
+            coerce(copy[i], params[i]);
+        return &copy;
+    }
+
+    std::vector<rule> m_rules;
+    std::vector<test> m_tests;
+    std::vector<std::vector<type>> m_groups;
+    std::vector<uint32_t> m_order;
+};
+
+};
@@ -0,0 +1,248 @@
+#include "compile.h"
+#include <cstddef>
+#include <type_traits>
+
+#pragma once
+
+namespace sexpr {
+
+// A column holds the values of one field for every row of a batch. Columns of
+// objects are used for fields whose values are not all of one type.
+
+using column = std::variant<std::vector<integer>, std::vector<real>,
+                            std::vector<atom>, std::vector<object>>;
+
+type type_of(const column &col)
+{
+    static const type types[] = { type::integer, type::real, type::string, type::any };
+    return types[col.index()];
+}
+
+// A batch of rows stored column by column. Column N is parameter $N of the
+// expressions of a pipeline.
+
+struct batch {
+    std::vector<column> columns;
+
+    size_t rows() const {
+        size_t rows = 0;
+        for (size_t i = 0; i < columns.size(); ++i) {
+            size_t size = std::visit([](const auto &col) { return col.size(); }, columns[i]);
+            if (i && size != rows)
+                throw std::invalid_argument("batch: Columns of different lengths.");
+            rows = size;
+        }
+        return rows;
+    }
+};
+
+// The output of a pipeline: the numbers of the rows that satisfied the
+// predicate, and for those rows only the value of each projection.
+
+struct selection {
+    std::vector<uint32_t> rows;
+    std::vector<column> columns;
+};
+
+// A predicate selects a row unless it evaluates to zero, an empty atom or an
+// empty list.
+
+bool truthy(const object &obj)
+{
+    if (auto *in = std::get_if<integer>(&obj))
+        return *in != 0;
+    if (auto *re = std::get_if<real>(&obj))
+        return *re != 0;
+    if (auto *at = std::get_if<atom>(&obj))
+        return !at->empty();
+    return !std::get_if<list>(&obj)->empty();
+}
+
+namespace {
+static void do_push_col(operand_stack *stack, const context *ctx, uint32_t idx, uint64_t row){
+    std::visit([&](const auto &col) { stack->push_back(col[row]); }, ctx->batch->columns[idx]);
+};
+
+static bool do_select(operand_stack *stack, const context *ctx, uint64_t row){
+    bool keep = truthy(stack->back());
+    stack->pop_back();
+    if (keep)
+        ctx->selection->rows.push_back(row);
+    return keep;
+};
+
+// Projections whose type was inferred are stored unboxed into a column of that
+// type without any checks.
+
+static void do_store(operand_stack *stack, const context *ctx, uint32_t idx){
+    std::visit([&](auto &col) {
+        using T = typename std::decay_t<decltype(col)>::value_type;
+        if constexpr (std::is_same_v<T, object>)
+            col.push_back(std::move(stack->back()));
+        else
+            col.push_back(std::move(*std::get_if<T>(&stack->back())));
+    }, ctx->selection->columns[idx]);
+    stack->pop_back();
+};
+
+static const bool pipeline_symbols = [] {
+    symbols().emplace("%push_col", reinterpret_cast<uintptr_t>(do_push_col));
+    symbols().emplace("%select", reinterpret_cast<uintptr_t>(do_select));
+    symbols().emplace("%store", reinterpret_cast<uintptr_t>(do_store));
+    return true;
+}();
+};
+
+// A pipeline filters a batch with a predicate and projects the rows that pass
+// it, in a single loop over the rows. The loop, the predicate and projections
+// are all compiled together, with the types of the parameters taken from the
+// schema that the pipeline was compiled for, and the projections are only
+// evaluated for the rows that were selected.
+
+class pipeline {
+public:
+    pipeline(std::shared_ptr<const image> image, std::vector<type> schema, std::vector<type> results)
+    : m_image{std::move(image)}
+    , m_schema{std::move(schema)}
+    , m_results{std::move(results)} {}
+
+    selection operator ()(const batch &input) const {
+        int64_t fuel = std::numeric_limits<int64_t>::max();
+        return *(*this)(input, fuel);
+    }
+
+    // Run the pipeline with at most the given amount of fuel, which is updated
+    // with what remains. Only pipelines compiled with compile_options::metered
+    // consume fuel, and return nothing once it has run out.
+
+    std::optional<selection> operator ()(const batch &input, int64_t &fuel) const {
+        trace::scope timed{"pipeline", "run"};
+        if (input.columns.size() < m_schema.size())
+            throw std::invalid_argument("pipeline: Too few columns.");
+        for (size_t i = 0; i < m_schema.size(); ++i) {
+            if (m_schema[i] != type::any && type_of(input.columns[i]) != m_schema[i])
+                throw std::invalid_argument("pipeline: Column of the wrong type.");
+        }
+        size_t rows = input.rows();
+        if (rows > std::numeric_limits<uint32_t>::max())
+            throw std::invalid_argument("pipeline: Batch too large.");
+
+        selection out;
+        for (auto ty : m_results) {
+            switch (ty) {
+            case type::integer: out.columns.emplace_back(std::vector<integer>{}); break;
+            case type::real:    out.columns.emplace_back(std::vector<real>{}); break;
+            case type::string:  out.columns.emplace_back(std::vector<atom>{}); break;
+            default:            out.columns.emplace_back(std::vector<object>{}); break;
+            }
+        }
+
+        operand_stack stack;
+        std::exception_ptr error;
+        context ctx{&m_image->immediates(), nullptr, nullptr, m_image->caches(), &input, &out, rows,
+                    nullptr, nullptr, nullptr, nullptr, &fuel, &error};
+        (*reinterpret_cast<void (*)(operand_stack *, const context *)>(m_image->code()))(
+            &stack, &ctx);
+        if (error)
+            std::rethrow_exception(error);
+        if (fuel < 0)
+            return std::nullopt;
+        return out;
+    }
+
+    const std::vector<type> &schema() const { return m_schema; }
+
+    // The types of the columns of the selection.
+
+    const std::vector<type> &results() const { return m_results; }
+private:
+    std::shared_ptr<const image> m_image;
+    std::vector<type> m_schema;
+    std::vector<type> m_results;
+};
+
+// Compile a pipeline for batches whose columns have the types in schema. Of
+// the options, only metering applies to pipelines, which charge the fuel for
+// every row at the back edge of the loop.
+
+pipeline compile(const list &predicate, const std::vector<list> &projections,
+                 const std::vector<type> &schema, const compile_options &options = {})
+{
+    // The x64 instructions that we will need when building the loop are
+    // defined here. The row number is kept in rbx and the number of rows in
+    // r12, both of which are preserved across calls, as are the operand stack
+    // and context that the assembler keeps in r13 and r14.
+
+    constexpr std::string_view prologue("\x53\x41\x54\x41\x55\x41\x56\x41\x57"
+                                        "\x49\x89\xfd\x49\x89\xf6\x31\xdb", 17);
+    constexpr std::string_view epilogue("\x41\x5f\x41\x5e\x41\x5d\x41\x5c\x5b\xc3", 10);
+    constexpr std::string_view cmp_rbx_r12 = "\x4c\x39\xe3";
+    constexpr std::string_view test_al_al  = "\x84\xc0";
+    constexpr std::string_view inc_rbx     = "\x48\xff\xc3";
+    constexpr std::string_view jae_rel32   = "\x0f\x83";
+    constexpr std::string_view jz_rel32    = "\x0f\x84";
+    constexpr std::string_view jmp_rel32   = "\xe9";
+
+    // Load the number of rows from the context, and call %select with the
+    // operand stack, the context and the row number.
+
+    constexpr stencil rows = {
+        std::string_view("\x4d\x8b\xa6\0\0\0\0", 7), 3, -1
+    };
+
+    constexpr stencil select = {
+        std::string_view("\x4c\x89\xef\x4c\x89\xf6\x48\x89\xda\xff\x15\0\0\0\0", 15), -1, 11
+    };
+
+    typing where = infer(predicate, signatures, nullptr, &schema);
+    std::vector<typing> what;
+    std::vector<type> results;
+    for (const auto &projection : projections) {
+        what.push_back(infer(projection, signatures, nullptr, &schema));
+        results.push_back(what.back().result);
+    }
+    for (const auto &types : what) {
+        if (types.params.size() > schema.size())
+            throw std::runtime_error("compile: No such column.");
+    }
+    if (where.params.size() > schema.size())
+        throw std::runtime_error("compile: No such column.");
+
+    assembler as{options};
+    size_t offset = as.here();
+    as.put(prologue);
+    as.put(rows, offsetof(context, rows));
+
+    size_t loop = as.here();
+    as.put(cmp_rbx_r12);
+    size_t done = as.jump(jae_rel32);
+
+    as.body(predicate, where, false, true);
+    as.put(select, 0, "%select");
+    as.put(test_al_al);
+    size_t next = as.jump(jz_rel32);
+
+    for (size_t i = 0; i < projections.size(); ++i) {
+        as.body(projections[i], what[i], false, true);
+        as.put(helper, i, "%store");
+    }
+
+    as.land(next);
+    size_t cost = 0, exhausted = 0;
+    if (options.metered) {
+        exhausted = as.meter(cost);
+        as.charge(cost, as.spent());
+    }
+    as.put(inc_rbx);
+    as.jump_back(jmp_rel32, loop);
+    as.land(done);
+    if (options.metered)
+        as.land(exhausted);
+    as.bail();
+    as.put(epilogue);
+
+    entry main{offset, schema, {}, as.here() - offset, {}};
+    return pipeline{as.link({{"", std::move(main)}}, {}), schema, std::move(results)};
+}
+
+};
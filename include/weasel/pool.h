@@ -0,0 +1,207 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#pragma once
+
+namespace sexpr {
+
+// A work stealing thread pool. Every worker has its own deque of tasks: it
+// pushes and pops tasks at the back, so that it works on what it spawned most
+// recently while the data is still in cache, and idle workers steal from the
+// front of the others. Threads waiting for a group of tasks help run tasks
+// until the group is done, so that tasks may spawn and wait on tasks of their
+// own without tying up the pool.
+
+class pool {
+public:
+    // A set of tasks that can be waited on together. The first exception
+    // thrown by one of them is rethrown by wait().
+
+    class group {
+    public:
+        group() = default;
+        group(const group &) = delete;
+        group &operator =(const group &) = delete;
+    private:
+        friend class pool;
+        std::atomic<size_t> m_pending{0};
+        std::mutex m_lock;
+        std::exception_ptr m_error;
+    };
+
+    explicit pool(size_t threads = std::max(1u, std::thread::hardware_concurrency()))
+    : m_workers(threads) {
+        for (auto &worker : m_workers)
+            worker = std::make_unique<struct worker>();
+        for (size_t i = 0; i < threads; ++i)
+            m_threads.emplace_back([this, i] { work(i); });
+    }
+
+    pool(const pool &) = delete;
+    pool &operator =(const pool &) = delete;
+
+    ~pool() {
+        {
+            std::lock_guard<std::mutex> lock{m_sleep};
+            m_stop = true;
+        }
+        m_wake.notify_all();
+        for (auto &thread : m_threads)
+            thread.join();
+    }
+
+    size_t size() const { return m_workers.size(); }
+
+    // Queue a task, on the deque of the calling worker if it belongs to this
+    // pool, or else on the deques of the workers in turn.
+
+    void spawn(group &g, std::function<void()> fn) {
+        g.m_pending.fetch_add(1, std::memory_order_relaxed);
+        size_t idx = s_current.owner == this
+                   ? s_current.index
+                   : m_next.fetch_add(1, std::memory_order_relaxed) % m_workers.size();
+        {
+            std::lock_guard<std::mutex> lock{m_workers[idx]->lock};
+            m_workers[idx]->tasks.push_back(task{std::move(fn), &g});
+        }
+        {
+            std::lock_guard<std::mutex> lock{m_sleep};
+            ++m_queued;
+        }
+        m_wake.notify_one();
+    }
+
+    // Run tasks until every task of the group has finished, sleeping while
+    // there is nothing to run until either a task is queued or the last task
+    // of the group finishes.
+
+    void wait(group &g) {
+        auto done = [&] { return !g.m_pending.load(std::memory_order_acquire); };
+        while (!done()) {
+            task t;
+            if (take(t)) {
+                run(t);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock{m_sleep};
+            m_wake.wait(lock, [&] { return m_queued > 0 || done(); });
+        }
+        if (g.m_error)
+            std::rethrow_exception(g.m_error);
+    }
+
+    // Call fn(i) for every i below n in parallel, returning once all are done.
+
+    template <typename F>
+    void parallel_for(size_t n, F &&fn) {
+        group g;
+        for (size_t i = 0; i < n; ++i)
+            spawn(g, [&fn, i] { fn(i); });
+        wait(g);
+    }
+
+    // A pool with a worker per hardware thread, started on first use.
+
+    static pool &shared() {
+        static pool shared;
+        return shared;
+    }
+private:
+    struct task {
+        std::function<void()> fn;
+        group *g = nullptr;
+    };
+
+    struct worker {
+        std::mutex lock;
+        std::deque<task> tasks;
+    };
+
+    // Take the most recent task of the calling worker, or else steal the
+    // oldest task of another.
+
+    bool take(task &t) {
+        size_t self = s_current.owner == this ? s_current.index : 0;
+        for (size_t i = 0; i < m_workers.size(); ++i) {
+            auto &worker = *m_workers[(self + i) % m_workers.size()];
+            std::lock_guard<std::mutex> lock{worker.lock};
+            if (worker.tasks.empty())
+                continue;
+            if (i == 0 && s_current.owner == this) {
+                t = std::move(worker.tasks.back());
+                worker.tasks.pop_back();
+            }
+            else {
+                t = std::move(worker.tasks.front());
+                worker.tasks.pop_front();
+            }
+            std::lock_guard<std::mutex> sleep{m_sleep};
+            --m_queued;
+            return true;
+        }
+        return false;
+    }
+
+    void run(task &t) {
+        try {
+            t.fn();
+        }
+        catch (...) {
+            std::lock_guard<std::mutex> lock{t.g->m_lock};
+            if (!t.g->m_error)
+                t.g->m_error = std::current_exception();
+        }
+        // The group may be gone as soon as its count drops to zero, but the
+        // lock is only taken so that a thread about to wait on it cannot miss
+        // the notification.
+
+        if (t.g->m_pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            {
+                std::lock_guard<std::mutex> lock{m_sleep};
+            }
+            m_wake.notify_all();
+        }
+    }
+
+    void work(size_t idx) {
+        s_current = {this, idx};
+        for (;;) {
+            task t;
+            if (take(t)) {
+                run(t);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock{m_sleep};
+            m_wake.wait(lock, [this] { return m_stop || m_queued > 0; });
+            if (m_stop)
+                return;
+        }
+    }
+
+    // The pool and index of the worker running on this thread, zeroed for
+    // threads that are not workers.
+
+    struct current {
+        const pool *owner;
+        size_t index;
+    };
+    static inline thread_local current s_current;
+
+    std::vector<std::unique_ptr<worker>> m_workers;
+    std::vector<std::thread> m_threads;
+    std::atomic<size_t> m_next{0};
+    std::mutex m_sleep;
+    std::condition_variable m_wake;
+    long m_queued = 0;
+    bool m_stop = false;
+};
+
+};
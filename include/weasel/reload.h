@@ -0,0 +1,162 @@
+#include "compile.h"
+#include "validate.h"
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#pragma once
+
+namespace sexpr {
+
+// Split a source into the spans of its top level calls, each running from the
+// start of its operator to its closing parenthesis. Top level atoms are not
+// calls and are skipped. The source must already have been checked.
+
+std::vector<std::string_view> split(std::string_view src)
+{
+    std::vector<std::string_view> res;
+    size_t depth = 0;
+    size_t start = 0;
+    for (size_t i = 0; i < src.size(); ++i) {
+        char c = src[i];
+        if (c == '"' && (i == 0 || delimiter(src[i - 1]))) {
+            for (++i; i < src.size() && src[i] != '"'; ++i)
+                if (src[i] == '\\')
+                    ++i;
+        }
+        else if (c == '(')
+            ++depth;
+        else if (c == ')' && !--depth)
+            res.push_back(src.substr(start, i + 1 - start));
+
+        if (!depth && (c == '\n' || c == ',' || c == ')'))
+            start = i + 1;
+    }
+    return res;
+}
+
+// The rules of a file, which are its top level calls. Reloading a new version
+// of the file only reads and compiles the rules whose text changed, and keeps
+// the tree and function of every other rule, matching them by a fingerprint of
+// their text wherever they moved to. The rules that are compiled by a reload
+// share modules of up to batch rules each, so that a large file takes a few
+// images rather than one per rule. A module is kept for as long as any of its
+// rules is, so once fewer than half of them are left, they are compiled again
+// along with the changed rules to let it go.
+
+class rule_set {
+public:
+    struct rule {
+        std::string text;
+        list root;
+        native_function function;
+    };
+
+    explicit rule_set(const compile_options &options = {}, size_t batch = 4096)
+    : m_options{options}
+    , m_batch{std::max<size_t>(batch, 1)} {}
+
+    // Replace the rules with those of the given source, returning how many of
+    // them had to be compiled, including those compiled again. Nothing changes
+    // if the source is broken or a rule fails to compile.
+
+    size_t reload(std::string_view src)
+    {
+        trace::scope timed{"reload"};
+        check(src);
+        auto texts = split(src);
+
+        std::unordered_multimap<uint64_t, std::shared_ptr<const held>> known;
+        for (const auto &r : m_rules)
+            known.emplace(r->fingerprint, r);
+
+        std::vector<std::shared_ptr<const held>> rules(texts.size());
+        std::unordered_map<const unit *, size_t> alive;
+        std::unordered_set<const held *> kept;
+        for (size_t i = 0; i < texts.size(); ++i) {
+            auto [first, last] = known.equal_range(fingerprint(texts[i]));
+            auto found = std::find_if(first, last, [&](const auto &k) {
+                return k.second->body.text == texts[i];
+            });
+            if (found != last) {
+                rules[i] = found->second;
+                if (kept.insert(rules[i].get()).second)
+                    ++alive[rules[i]->owner.get()];
+            }
+        }
+        for (auto &r : rules)
+            if (r && alive[r->owner.get()] * 2 < r->owner->rules)
+                r = nullptr;
+
+        // The distinct texts that are left are read and compiled in batches.
+
+        std::unordered_map<std::string_view, size_t> fresh;
+        std::vector<std::string_view> sources;
+        std::vector<std::pair<std::string, list>> exprs;
+        std::vector<size_t> slots(texts.size());
+        for (size_t i = 0; i < texts.size(); ++i) {
+            if (rules[i])
+                continue;
+            auto [it, added] = fresh.emplace(texts[i], exprs.size());
+            if (added) {
+                object obj = read(texts[i]);
+                sources.push_back(texts[i]);
+                exprs.emplace_back(std::to_string(exprs.size()), std::move(*std::get_if<list>(&obj)));
+            }
+            slots[i] = it->second;
+        }
+
+        std::vector<std::shared_ptr<const held>> built;
+        for (size_t b = 0; b < exprs.size(); b += m_batch) {
+            size_t n = std::min(m_batch, exprs.size() - b);
+            std::vector<std::pair<std::string, list>> part(std::make_move_iterator(exprs.begin() + b),
+                                                           std::make_move_iterator(exprs.begin() + b + n));
+            module mod = compile(part, m_options);
+            auto owner = std::make_shared<const unit>(unit{n});
+            for (size_t k = 0; k < n; ++k) {
+                auto fn = mod[part[k].first];
+                std::string text(sources[b + k]);
+                uint64_t hash = fingerprint(text);
+                built.push_back(std::make_shared<const held>(
+                    held{rule{std::move(text), std::move(part[k].second), std::move(fn)}, hash, owner}));
+            }
+        }
+        for (size_t i = 0; i < texts.size(); ++i)
+            if (!rules[i])
+                rules[i] = built[slots[i]];
+
+        m_rules = std::move(rules);
+        return built.size();
+    }
+
+    size_t size() const { return m_rules.size(); }
+    const rule &operator [](size_t idx) const { return m_rules[idx]->body; }
+
+private:
+    // The rules that were compiled together into one module.
+
+    struct unit {
+        size_t rules;
+    };
+
+    struct held {
+        rule body;
+        uint64_t fingerprint;
+        std::shared_ptr<const unit> owner;
+    };
+
+    static uint64_t fingerprint(std::string_view text)
+    {
+        return std::hash<std::string_view>{}(text);
+    }
+
+    compile_options m_options;
+    size_t m_batch;
+    std::vector<std::shared_ptr<const held>> m_rules;
+};
+
+};
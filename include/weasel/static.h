@@ -0,0 +1,548 @@
+#include "compile.h"
+#include <array>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#pragma once
+
+namespace sexpr {
+
+// The syntax tree of an expression read at compile time. Nodes are either
+// calls, which are lists, or atoms, and the children of a call are linked
+// through their next fields. Node 0 is the list that read() collects the
+// top level objects in, of which the root is the first.
+
+template <size_t N>
+struct syntax {
+    static constexpr size_t none = size_t(-1);
+
+    struct node {
+        std::string_view text{};
+        bool call = false;
+        bool quoted = false;
+        bool escaped = false;
+        size_t child = none;
+        size_t last = none;
+        size_t next = none;
+    };
+
+    node nodes[N]{};
+    size_t size = 0;
+    size_t root = none;
+};
+
+// Read an expression at compile time, exactly as read() would at runtime. An
+// unbalanced parenthesis or an empty source is a compile error. There can be
+// no more nodes than delimiters, so the source length bounds their number.
+// The text of a string literal is left escaped, since it is a view of the
+// source, and unescaped by text() when an atom is made of it. String literals
+// are marked as quoted, and are never taken for numbers or parameters.
+
+template <size_t N>
+constexpr syntax<N> parse(std::string_view src)
+{
+    using tree = syntax<N>;
+
+    tree res{};
+    std::string_view contents;
+    bool quoted = false, escaped = false;
+    auto add = [&](size_t parent, std::string_view text, bool call) {
+        size_t idx = res.size++;
+        res.nodes[idx].text = quoted ? contents : text;
+        res.nodes[idx].call = call;
+        res.nodes[idx].quoted = quoted;
+        res.nodes[idx].escaped = escaped;
+        quoted = escaped = false;
+        auto &top = res.nodes[parent];
+        if (top.last == tree::none)
+            top.child = idx;
+        else
+            res.nodes[top.last].next = idx;
+        top.last = idx;
+        return idx;
+    };
+
+    size_t ctx[N]{};
+    size_t depth = 1;
+    res.nodes[res.size++].call = true;
+
+    size_t start = 0;
+    for (size_t i = 0; i < src.size(); ++i) {
+        char c = src[i];
+        std::string_view token = src.substr(start, i - start);
+        if (c == '\n' || c == ',' || c == '(' || c == ')')
+            start = i + 1;
+
+        if (c == '\n') {
+            if (!token.empty() || quoted)
+                add(ctx[depth-1], token, false);
+        }
+        else if (c == ',')
+            add(ctx[depth-1], token, false);
+        else if (c == '(') {
+            size_t idx = add(ctx[depth-1], token, true);
+            ctx[depth++] = idx;
+        }
+        else if (c == ')') {
+            if (!token.empty() || quoted)
+                add(ctx[depth-1], token, false);
+            if (depth == 1)
+                throw std::logic_error("read: Unbalanced parenthesis.");
+            --depth;
+        }
+        else if (quoted)
+            throw std::logic_error("read: Characters after a string literal.");
+        else if (c == '"' && token.empty()) {
+            size_t first = i + 1;
+            for (++i; i < src.size() && src[i] != '"'; ++i) {
+                if (src[i] == '\\') {
+                    escaped = true;
+                    ++i;
+                }
+            }
+            if (i >= src.size())
+                throw std::logic_error("read: Unterminated string literal.");
+            contents = src.substr(first, i - first);
+            quoted = true;
+        }
+    }
+    if (depth != 1)
+        throw std::logic_error("read: Unbalanced parenthesis.");
+    res.root = res.nodes[0].child;
+    if (res.root == tree::none)
+        throw std::logic_error("read: Empty expression.");
+    return res;
+}
+
+namespace {
+// The text of a node as an atom, with the escapes of a string literal replaced.
+
+template <typename Node>
+static atom text(const Node &node)
+{
+    atom res = node.escaped ? unescape(node.text) : atom(node.text);
+    res.quoted = node.quoted;
+    return res;
+}
+
+// The value of a literal as far as it can be told at compile time. Numbers
+// that cannot be converted exactly without from_chars, which is not constexpr,
+// are left as any to be converted at runtime.
+
+struct constant {
+    type ty = type::string;
+    integer in = 0;
+    real re = 0;
+};
+
+static constexpr bool digit(char c) { return c >= '0' && c <= '9'; }
+
+static constexpr constant spell(std::string_view at)
+{
+    constant res;
+    if (at.empty() || !(at[0] == '-' || at[0] == '.' || digit(at[0])))
+        return res;
+
+    bool negative = at[0] == '-';
+    size_t first = negative;
+    uint64_t mag = 0;
+    bool overflow = false;
+    size_t i = first;
+    for (; i < at.size() && digit(at[i]); ++i) {
+        uint64_t d = at[i] - '0';
+        if (mag > (std::numeric_limits<uint64_t>::max() - d) / 10)
+            overflow = true;
+        else
+            mag = mag * 10 + d;
+    }
+    uint64_t limit = uint64_t(std::numeric_limits<integer>::max()) + negative;
+    if (i == at.size() && i > first && !overflow && mag <= limit) {
+        res.ty = type::integer;
+        res.in = !mag ? 0 : negative ? -integer(mag - 1) - 1 : integer(mag);
+        return res;
+    }
+
+    // Infinities and NaNs are only spelled with a sign here, since atoms that
+    // start with a letter are never numbers.
+
+    if (negative && first < at.size()) {
+        char c = at[first] | 0x20;
+        if (c == 'i' || c == 'n') {
+            res.ty = type::any;
+            return res;
+        }
+    }
+
+    // Collect up to 19 significant digits and the power of ten that they are
+    // to be scaled by.
+
+    uint64_t m = 0;
+    int digits = 0, exp10 = 0;
+    bool any = false, lost = false;
+    auto accumulate = [&](char c, bool fraction) {
+        int d = c - '0';
+        any = true;
+        if (!m && !d) {
+            exp10 -= fraction;
+            return;
+        }
+        if (digits < 19) {
+            m = m * 10 + d;
+            ++digits;
+            exp10 -= fraction;
+        }
+        else {
+            lost |= d != 0;
+            exp10 += !fraction;
+        }
+    };
+    i = first;
+    for (; i < at.size() && digit(at[i]); ++i)
+        accumulate(at[i], false);
+    if (i < at.size() && at[i] == '.') {
+        for (++i; i < at.size() && digit(at[i]); ++i)
+            accumulate(at[i], true);
+    }
+    if (!any)
+        return res;
+    if (i < at.size() && (at[i] == 'e' || at[i] == 'E')) {
+        size_t e = i + 1;
+        bool eneg = false;
+        if (e < at.size() && (at[e] == '+' || at[e] == '-'))
+            eneg = at[e++] == '-';
+        if (e == at.size() || !digit(at[e]))
+            return res;
+        int ev = 0;
+        for (; e < at.size() && digit(at[e]); ++e)
+            ev = ev < 100000 ? ev * 10 + (at[e] - '0') : ev;
+        exp10 += eneg ? -ev : ev;
+        i = e;
+    }
+    if (i != at.size())
+        return res;
+
+    // A mantissa and power of ten that are both exactly representable give a
+    // correctly rounded result in a single operation, as from_chars would.
+
+    constexpr double powers[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    res.ty = type::any;
+    if (lost)
+        return res;
+    if (!m) {
+        res.ty = type::real;
+        res.re = negative ? -0.0 : 0.0;
+    }
+    else if (m <= uint64_t(1) << 53 && exp10 >= -22 && exp10 <= 22) {
+        res.ty = type::real;
+        res.re = exp10 < 0 ? double(m) / powers[-exp10] : double(m) * powers[exp10];
+        res.re = negative ? -res.re : res.re;
+    }
+    return res;
+}
+
+// The compile time counterpart of parameter().
+
+struct argument {
+    bool is = false;
+    uint32_t idx = 0;
+    type ty = type::any;
+};
+
+static constexpr argument spell_parameter(std::string_view at)
+{
+    argument res;
+    if (at.size() < 2 || at[0] != '$' || !digit(at[1]))
+        return res;
+
+    uint64_t idx = 0;
+    size_t i = 1;
+    for (; i < at.size() && digit(at[i]); ++i) {
+        idx = idx * 10 + (at[i] - '0');
+        if (idx > std::numeric_limits<uint32_t>::max())
+            return res;
+    }
+    res.idx = idx;
+    if (i == at.size()) {
+        res.is = true;
+        return res;
+    }
+    if (at[i] != ':')
+        return res;
+
+    std::string_view name = at.substr(i + 1);
+    if (name == "int")
+        res.ty = type::integer;
+    else if (name == "real")
+        res.ty = type::real;
+    else if (name == "str")
+        res.ty = type::string;
+    else if (name == "list")
+        res.ty = type::list;
+    else
+        throw std::logic_error("infer: Unknown type annotation.");
+    res.is = true;
+    return res;
+}
+
+template <typename S>
+inline constexpr auto tree = parse<S::str().size() + 1>(S::str());
+
+template <typename S>
+constexpr size_t none = std::remove_reference_t<decltype(tree<S>)>::none;
+
+template <typename S, size_t I>
+constexpr size_t arity()
+{
+    size_t n = 0;
+    for (size_t c = tree<S>.nodes[I].child; c != none<S>; c = tree<S>.nodes[c].next)
+        ++n;
+    return n;
+}
+
+template <typename S, size_t I, size_t K>
+constexpr size_t child()
+{
+    size_t c = tree<S>.nodes[I].child;
+    for (size_t k = 0; k < K; ++k)
+        c = tree<S>.nodes[c].next;
+    return c;
+}
+
+// Collect the types of the parameters as params() does, from the atoms that
+// are children of calls. Quoted lists are values, so are left alone.
+
+template <typename S, typename F>
+constexpr void parameters(F &&fn)
+{
+    size_t todo[sizeof(tree<S>.nodes) / sizeof(tree<S>.nodes[0])]{};
+    size_t depth = 0;
+    todo[depth++] = tree<S>.root;
+    while (depth) {
+        const auto &call = tree<S>.nodes[todo[--depth]];
+        if (!call.call || call.text.empty())
+            continue;
+        for (size_t c = call.child; c != none<S>; c = tree<S>.nodes[c].next) {
+            const auto &node = tree<S>.nodes[c];
+            if (node.call)
+                todo[depth++] = c;
+            else if (auto param = spell_parameter(node.text); param.is && !node.quoted)
+                fn(param);
+        }
+    }
+}
+
+template <typename S>
+constexpr size_t count_params()
+{
+    size_t n = 0;
+    parameters<S>([&](const argument &param) { n = std::max<size_t>(n, param.idx + 1); });
+    return n;
+}
+
+template <typename S>
+constexpr auto static_params()
+{
+    std::array<type, count_params<S>()> res{};
+    parameters<S>([&](const argument &param) {
+        if (param.ty == type::any)
+            return;
+        if (res[param.idx] != type::any && res[param.idx] != param.ty)
+            throw std::logic_error("infer: Conflicting type annotations.");
+        res[param.idx] = param.ty;
+    });
+    return res;
+}
+
+template <typename T>
+constexpr type static_type()
+{
+    if constexpr (std::is_same_v<T, integer>)
+        return type::integer;
+    else if constexpr (std::is_same_v<T, real>)
+        return type::real;
+    else if constexpr (std::is_same_v<T, atom>)
+        return type::string;
+    else if constexpr (std::is_same_v<T, list>)
+        return type::list;
+    else
+        return type::any;
+}
+
+// Lists without an operator are quoted, and are values made of the atoms,
+// numbers and lists that they were read as.
+
+template <typename S>
+list quote(size_t idx)
+{
+    list res{text(tree<S>.nodes[idx])};
+    for (size_t c = tree<S>.nodes[idx].child; c != none<S>; c = tree<S>.nodes[c].next)
+        res.push_back(tree<S>.nodes[c].call ? object{quote<S>(c)} : literal(text(tree<S>.nodes[c])));
+    return res;
+}
+
+// Call a builtin through the registry, choosing the implementation once from
+// the static operand types as infer() would, or on every call from the types
+// of the operands where it would be dispatched at runtime.
+
+template <typename S, size_t I, typename... T>
+object call_builtin(operand_stack operands)
+{
+    struct binding {
+        const signature *sig;
+        uintptr_t fn;
+    };
+    static const binding site = [] {
+        std::string name = text(tree<S>.nodes[I]);
+        std::vector<type> types = { static_type<T>()... };
+        type result;
+        if (dispatched(signatures, name, types, result))
+            return binding{nullptr, 0};
+        const signature *sig = resolve(signatures, name, types);
+        return binding{sig, resolve(sig->symbol)};
+    }();
+
+    const signature *sig = site.sig;
+    uintptr_t fn = site.fn;
+    if (!sig) {
+        std::vector<type> types;
+        for (const auto &obj : operands)
+            types.push_back(type_of(obj));
+        sig = best(signatures, text(tree<S>.nodes[I]), types);
+        if (!sig)
+            throw std::invalid_argument("No matching implementation.");
+        fn = resolve(sig->symbol);
+    }
+    if (sig->async)
+        return await(reinterpret_cast<async_builtin>(fn),
+                     std::vector<object>(std::make_move_iterator(operands.begin()),
+                                         std::make_move_iterator(operands.end())));
+    reinterpret_cast<void (*)(operand_stack *)>(fn)(&operands);
+    return std::move(operands.back());
+}
+
+template <typename S, size_t I>
+auto eval(const std::vector<object> &args);
+
+// Evaluate the operands of a call from left to right, as the compiled code
+// would. Arithmetic on operands of the same numeric type is done inline unless
+// define() has replaced it, and everything else is called through the registry.
+
+template <typename S, size_t I, size_t... K>
+auto operate(const std::vector<object> &args, std::index_sequence<K...>)
+{
+    using operands = std::tuple<decltype(eval<S, child<S, I, K>()>(args))...>;
+    operands ops{eval<S, child<S, I, K>()>(args)...};
+
+    constexpr std::string_view op = tree<S>.nodes[I].text;
+    if constexpr (sizeof...(K) == 2 && (op == "+" || op == "*")) {
+        using A = std::tuple_element_t<0, operands>;
+        using B = std::tuple_element_t<1, operands>;
+        if constexpr (std::is_same_v<A, B> && (std::is_same_v<A, integer> || std::is_same_v<A, real>)) {
+            static const bool native = [] {
+                std::vector<type> types = { static_type<A>(), static_type<B>() };
+                const signature *sig = resolve(signatures, text(tree<S>.nodes[I]), types);
+                return resolve(sig->symbol) == builtins.at(sig->symbol);
+            }();
+            if (native) {
+                if constexpr (op == "+")
+                    return A(std::get<0>(ops) + std::get<1>(ops));
+                else
+                    return A(std::get<0>(ops) * std::get<1>(ops));
+            }
+            object res = call_builtin<S, I, A, B>({object{std::move(std::get<K>(ops))}...});
+            if (auto *val = std::get_if<A>(&res))
+                return *val;
+            throw std::invalid_argument("Result of the wrong type.");
+        }
+        else
+            return call_builtin<S, I, A, B>({object{std::move(std::get<K>(ops))}...});
+    }
+    else {
+        return call_builtin<S, I, std::tuple_element_t<K, operands>...>(
+            {object{std::move(std::get<K>(ops))}...});
+    }
+}
+
+template <typename S, size_t I>
+auto eval(const std::vector<object> &args)
+{
+    constexpr const auto &node = tree<S>.nodes[I];
+    if constexpr (node.call && !node.text.empty())
+        return operate<S, I>(args, std::make_index_sequence<arity<S, I>()>{});
+    else if constexpr (node.call) {
+        static const list value = quote<S>(I);
+        return value;
+    }
+    else if constexpr (node.quoted)
+        return text(node);
+    else if constexpr (constexpr auto param = spell_parameter(node.text); param.is) {
+        constexpr type ty = static_params<S>()[param.idx];
+        const object &arg = args[param.idx];
+        if constexpr (ty == type::integer)
+            return *std::get_if<integer>(&arg);
+        else if constexpr (ty == type::real)
+            return *std::get_if<real>(&arg);
+        else if constexpr (ty == type::string)
+            return *std::get_if<atom>(&arg);
+        else if constexpr (ty == type::list)
+            return *std::get_if<list>(&arg);
+        else
+            return arg;
+    }
+    else {
+        constexpr auto lit = spell(node.text);
+        if constexpr (lit.ty == type::integer)
+            return integer(lit.in);
+        else if constexpr (lit.ty == type::real)
+            return real(lit.re);
+        else if constexpr (lit.ty == type::string)
+            return text(node);
+        else {
+            static const object value = literal(text(node));
+            return value;
+        }
+    }
+}
+};
+
+// An expression that was read and typed at compile time, from the source
+// returned by S::str(). Operands whose types are known statically are held
+// unboxed, and arithmetic on them is inlined, while calls to other builtins go
+// through the same registry as compiled code, so that the result is the same
+// as that of compile(). Whether + and * on two integers or two reals are still
+// the original ones, and so can be inlined, is checked on their first call.
+
+template <typename S>
+class static_function {
+public:
+    static_assert(tree<S>.nodes[tree<S>.root].call, "static_function: Expression is not a call.");
+
+    object operator ()(std::vector<object> args = {}) const {
+        constexpr auto types = static_params<S>();
+        if (args.size() < types.size())
+            throw std::invalid_argument("native_function: Too few arguments.");
+        for (size_t i = 0; i < types.size(); ++i)
+            coerce(args[i], types[i]);
+        return object{eval<S, tree<S>.root>(args)};
+    }
+
+    // The types that the parameters were annotated with.
+
+    static constexpr auto params() { return static_params<S>(); }
+};
+
+};
+
+// Read an expression from a string literal at compile time, giving a
+// static_function for it.
+
+#define SEXPR_STATIC(src) \
+    ([] { \
+        struct source { static constexpr std::string_view str() { return src; } }; \
+        return sexpr::static_function<source>{}; \
+    }())
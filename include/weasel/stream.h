@@ -1,8 +1,18 @@
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
 #include <string>
+#include <string_view>
 #include <variant>
 #include <vector>
 #include <functional>
 #include <iostream>
+#include <iterator>
+#include <memory_resource>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include "trace.h"
 
 #pragma once
 
@@ -10,74 +20,434 @@ namespace sexpr {
 
 // Objects are split into two categories: atom and list. atoms are values
 // such as numbers and strings, and lists are unordered sets of objects other
-// objects.
+// objects. Numbers are read as their integer or real value, while atoms made
+// elsewhere, such as arguments, may still spell numbers and are parsed when used.
+// Atoms read from string literals are quoted, and are strings whatever they
+// spell.
 
-using atom = std::string;
-using object = std::variant<struct list, atom>;
+struct atom : std::string {
+    using std::string::string;
+    atom() = default;
+    atom(std::string str, bool quoted = false)
+    : std::string(std::move(str))
+    , quoted{quoted} {}
 
-struct list : std::vector<object> {
+    bool quoted = false;
+};
+
+using integer = std::int64_t;
+using real = double;
+using object = std::variant<struct list, atom, integer, real>;
+
+struct list : std::pmr::vector<object> {
     atom op;
-    list(atom &&op)
-    : op{op} {}
+    list(atom &&op, std::pmr::memory_resource *resource = std::pmr::get_default_resource())
+    : std::pmr::vector<object>(resource)
+    , op{std::move(op)} {}
+
+    // Copies are made a level at a time from a stack of their own, for the
+    // same reason as the destructor below. Like the children of a copied
+    // vector, they are allocated from the default resource.
+
+    list(const list &other)
+    : std::pmr::vector<object>(std::pmr::get_default_resource())
+    , op{other.op} {
+        std::vector<std::pair<list *, const list *>> todo = {{this, &other}};
+        while (!todo.empty()) {
+            auto [to, from] = todo.back();
+            todo.pop_back();
+            to->reserve(from->size());
+            for (const auto &child : *from) {
+                if (auto *li = std::get_if<list>(&child)) {
+                    to->emplace_back(list{atom{li->op}});
+                    todo.emplace_back(std::get_if<list>(&to->back()), li);
+                }
+                else
+                    to->push_back(child);
+            }
+        }
+    }
+
+    list(list &&) = default;
+
+    list &operator =(const list &other) {
+        if (this != &other)
+            *this = list{other};
+        return *this;
+    }
+
+    list &operator =(list &&) = default;
+
+    // Nested lists are moved out onto a stack and destroyed from there once
+    // their own children have been moved out, so that tearing down a deep
+    // expression does not recurse once per level of nesting.
+
+    ~list() {
+        auto nested = [](const object &obj) {
+            auto *li = std::get_if<list>(&obj);
+            return li && !li->empty();
+        };
+        if (std::none_of(begin(), end(), nested))
+            return;
+
+        std::vector<list> todo;
+        auto take = [&](list &parent) {
+            for (auto &child : parent)
+                if (nested(child))
+                    todo.push_back(std::move(*std::get_if<list>(&child)));
+        };
+        take(*this);
+        while (!todo.empty()) {
+            list li = std::move(todo.back());
+            todo.pop_back();
+            take(li);
+        }
+    }
+};
+
+// The operand stack that compiled code and builtins work on.
+
+using operand_stack = std::pmr::vector<object>;
+
+// Whether a text entirely spells a decimal number, storing its integer or real
+// value in val if one is given.
+
+bool number(std::string_view text, object *val = nullptr)
+{
+    if (text.empty() || !(text[0] == '-' || text[0] == '.' || (text[0] >= '0' && text[0] <= '9')))
+        return false;
+
+    const char *end = text.data() + text.size();
+    integer in;
+    auto res = std::from_chars(text.data(), end, in);
+    if (res.ec == std::errc{} && res.ptr == end) {
+        if (val)
+            *val = in;
+        return true;
+    }
+    real re;
+    res = std::from_chars(text.data(), end, re);
+    if (res.ec == std::errc{} && res.ptr == end) {
+        if (val)
+            *val = re;
+        return true;
+    }
+    return false;
+}
+
+// Replace an unquoted atom that entirely spells a decimal number with its
+// integer or real value. Returns false, leaving the object alone, for
+// everything else.
+
+bool number(object &obj)
+{
+    auto *at = std::get_if<atom>(&obj);
+    return at && !at->quoted && number(*at, &obj);
+}
+
+// Replace the escapes in the text of a string literal with the characters that
+// they stand for. \n, \t and \r are control characters, and a backslash before
+// any other character stands for that character.
+
+atom unescape(std::string_view text)
+{
+    atom res;
+    res.reserve(text.size());
+    for (size_t i = 0; i < text.size(); ++i) {
+        char c = text[i];
+        if (c == '\\' && i + 1 < text.size()) {
+            c = text[++i];
+            c = c == 'n' ? '\n' : c == 't' ? '\t' : c == 'r' ? '\r' : c;
+        }
+        res.push_back(c);
+    }
+    return res;
+}
+
+// Where the nodes of an expression were read from. read() records the byte
+// offset of each node in pre-order and the offset at which each line starts
+// as it goes. Nodes are identified by their index in pre-order, the root being
+// 0, so the table stays valid however the tree is moved about, as long as its
+// shape is not changed.
+
+struct locations {
+    std::vector<size_t> offsets;
+    std::vector<size_t> lines = {0};
+
+    // The offset of the node with the given index.
+
+    size_t offset(size_t index) const { return offsets.at(index); }
+
+    // Call fn with every node below root and its offset in pre-order, until it
+    // returns false. The root is the expression that was read, or the list
+    // moved out of it.
+
+    template <typename F>
+    void walk(const object &root, F &&fn) const
+    {
+        if (auto *li = std::get_if<list>(&root))
+            walk(*li, fn);
+    }
+
+    template <typename F>
+    void walk(const list &root, F &&fn) const
+    {
+        size_t idx = 1;
+        std::vector<const object *> todo;
+        for (auto it = root.rbegin(); it != root.rend(); ++it)
+            todo.push_back(&*it);
+        while (!todo.empty() && idx < offsets.size()) {
+            const object *obj = todo.back();
+            todo.pop_back();
+            if (!fn(*obj, offsets[idx++]))
+                return;
+            if (auto *li = std::get_if<list>(obj))
+                for (auto it = li->rbegin(); it != li->rend(); ++it)
+                    todo.push_back(&*it);
+        }
+    }
+
+    // The offset of a node of root, which is either an object or a list, found
+    // by walking root. Use walk() rather than this to visit many nodes.
+
+    template <typename T, typename N>
+    size_t offset(const T &root, const N &node) const
+    {
+        auto is = [&](const auto &obj) {
+            if constexpr (std::is_same_v<std::decay_t<decltype(obj)>, object>)
+                return (const void *)&obj == &node || (const void *)std::get_if<list>(&obj) == &node;
+            else
+                return (const void *)&obj == &node;
+        };
+        if (is(root))
+            return offset(0);
+        std::optional<size_t> res;
+        walk(root, [&](const object &obj, size_t at) {
+            if (is(obj))
+                res = at;
+            return !res;
+        });
+        if (!res)
+            throw std::out_of_range("locations: Not a node of the expression.");
+        return *res;
+    }
+
+    // The line and column of an offset, both counted from one.
+
+    std::pair<size_t, size_t> position(size_t offset) const
+    {
+        auto it = std::upper_bound(lines.begin(), lines.end(), offset);
+        return {size_t(it - lines.begin()), offset - *std::prev(it) + 1};
+    }
 };
 
-object read(std::istream &is)
+// Read an expression, allocating its lists from the given memory resource, such
+// as a monotonic buffer that is released after a request. Copies of the lists
+// are allocated from the default resource, while moving them keeps theirs.
+//
+// The children of the lists that are open are gathered on a stack of their own,
+// and only moved into their list once it is closed and its size is known, so
+// that each list makes a single allocation of exactly the size it needs rather
+// than growing one child at a time.
+//
+// A token that starts with a double quote is a string literal, which may hold
+// delimiters and runs up to the next quote that is not escaped. The literal is
+// a quoted atom, which is a string even where it spells a number or a
+// parameter. Quotes elsewhere in a token are ordinary characters.
+//
+// Positions are counted as characters are taken from the stream rather than
+// asked of it, and the offsets of nodes and lines are recorded in where if it
+// is given. Errors are reported with the line and column at which they
+// were found.
+
+object read(std::istream &is, std::pmr::memory_resource *resource = std::pmr::get_default_resource(),
+            locations *where = nullptr)
 {
-    list root{""};
-    std::vector<std::reference_wrapper<list>> ctx = { root }; 
-    
+    trace::scope timed{"read"};
+    std::vector<object> children;
+    std::vector<std::pair<atom, size_t>> ctx;
+    children.reserve(16);
+    ctx.reserve(16);
+
     std::string accum;
+    bool quoted = false;
     auto tokenize = [&]() -> atom {
-        atom res{std::move(accum)};
+        atom res{std::move(accum), quoted};
         accum.clear();
+        quoted = false;
         return res;
     };
-    
-    auto ll = is.tellg();
-    long ln = 1;
+    // Keep track of the offset of the current character and of the token that it
+    // is part of, as well as the line number and the offset at which the line
+    // starts for error reporting.
+
+    size_t pos = 0, start = 0;
+    size_t ln = 1, ll = 0;
+    auto newline = [&](size_t at) {
+        ++ln;
+        ll = at + 1;
+        if (where)
+            where->lines.push_back(ll);
+    };
+    auto fail = [&](const char *what, size_t line, size_t at) {
+        throw std::runtime_error(std::string("read: ") + what + " at " + std::to_string(line) + ":"
+                                 + std::to_string(at - ll + 1) + ".");
+    };
+    auto push = [&](atom &&token) {
+        number(children.emplace_back(std::move(token)));
+        if (where)
+            where->offsets.push_back(start);
+    };
+
     while (is) {
         auto c = is.get();
-        auto &top = ctx.back().get();
-        
+        size_t at = pos++;
+
         if (c == '\n') {
-            // Keep track of the current line number, as well as the position of
-            // the last line for error reporting.
-            
-            ++ln;
-            ll = is.tellg();
-            
+            newline(at);
+            bool kept = !accum.empty() || quoted;
             auto token = tokenize();
-            if (!token.empty())
-                top.push_back(token);
+            if (kept)
+                push(std::move(token));
         }
         else if (c == ',')
-            top.push_back(tokenize());
+            push(tokenize());
         else if (c == '(') {
-            auto &back = top.emplace_back(list{tokenize()});
-            ctx.push_back(*std::get_if<list>(&back));
+            ctx.emplace_back(tokenize(), children.size());
+            if (where)
+                where->offsets.push_back(start);
         }
         else if (c == ')') {
+            bool kept = !accum.empty() || quoted;
             auto token = tokenize();
-            if (!token.empty())
-                top.push_back(token);
-            ctx.pop_back();  // May throw on underflow.
+            if (kept)
+                push(std::move(token));
+            if (ctx.empty())
+                fail("Unbalanced parenthesis", ln, at);
+
+            auto [op, first] = std::move(ctx.back());
+            ctx.pop_back();
+            list li{std::move(op), resource};
+            li.reserve(children.size() - first);
+            std::move(children.begin() + first, children.end(), std::back_inserter(li));
+            children.erase(children.begin() + first, children.end());
+            children.push_back(std::move(li));
+        }
+        else if (quoted && c != std::istream::traits_type::eof())
+            fail("Characters after a string literal", ln, at);
+        else if (c == '"' && accum.empty()) {
+            // The stream buffer is searched for the closing quote a run at a
+            // time, rather than a character at a time as above. A quote that
+            // ends a run is escaped if an odd number of backslashes precede it.
+
+            std::string run;
+            size_t line = ln, first = ll;
+            for (;;) {
+                if (!std::getline(is, run, '"') || is.eof()) {
+                    ll = first;
+                    fail("Unterminated string literal", line, at);
+                }
+                for (size_t k = run.find('\n'); k != std::string::npos; k = run.find('\n', k + 1))
+                    newline(pos + k);
+                pos += run.size() + 1;
+                accum += run;
+                auto escapes = accum.size() - 1 - accum.find_last_not_of('\\');
+                if (escapes % 2 == 0)
+                    break;
+                accum.push_back('"');
+            }
+            if (accum.find('\\') != std::string::npos)
+                accum = unescape(accum);
+            quoted = true;
         }
         else
             accum.push_back(c);
+
+        if (c == '\n' || c == ',' || c == '(' || c == ')')
+            start = pos;
     }
-    return root.front();
+    if (!ctx.empty())
+        fail("Unbalanced parenthesis", ln, pos - 1);
+    if (children.empty())
+        fail("Empty expression", ln, pos - 1);
+    return std::move(children.front());
 }
 
-std::ostream &print(std::ostream &out, const object &obj)
+// Format a number into the given buffer, reals as the shortest text that reads
+// back as the same value rather than rounded to the precision of the stream.
+// Reals that would come out as bare digits are given a fraction, so that they
+// read back as reals rather than integers.
+
+template <typename T>
+std::string_view format(char (&buf)[32], T val)
 {
-    if (auto *li = std::get_if<list>(&obj)) {
-        out << li->op << "(";
-        for (const auto &obj : *li)
-            print(out, obj) << ",";
-        return out << "\b)";
+    auto res = std::to_chars(buf, buf + sizeof(buf), val);
+    if constexpr (std::is_floating_point_v<T>) {
+        if (std::all_of(buf, res.ptr, [](char c) { return c == '-' || (c >= '0' && c <= '9'); })) {
+            *res.ptr++ = '.';
+            *res.ptr++ = '0';
+        }
     }
-    else if (auto *at = std::get_if<atom>(&obj)) {
-        return out << *at;
+    return {buf, size_t(res.ptr - buf)};
+}
+
+// Print an object. Nested lists are walked with a stack of their own rather
+// than by recursion, so that the depth of an expression is not bounded by that
+// of the native stack.
+
+std::ostream &print(std::ostream &out, const object &obj)
+{
+    char buf[32];
+    std::vector<std::pair<const list *, size_t>> open;
+    const object *next = &obj;
+    for (;;) {
+        if (auto *li = std::get_if<list>(next)) {
+            out << li->op << "(";
+            open.emplace_back(li, 0);
+        }
+        else {
+            if (auto *at = std::get_if<atom>(next)) {
+                // Atoms that would not read back as themselves are written as
+                // string literals, as are quoted atoms that would otherwise
+                // read back as a number or a parameter.
+
+                bool spelled = at->quoted && (number(*at) || (at->size() > 1 && (*at)[0] == '$'
+                                                              && (*at)[1] >= '0' && (*at)[1] <= '9'));
+                bool plain = at->find_first_of("\n,()") == atom::npos && (at->empty() || (*at)[0] != '"')
+                          && !spelled;
+                if (plain)
+                    out << *at;
+                else {
+                    out << '"';
+                    for (char c : *at) {
+                        if (c == '"' || c == '\\' || c == '\n')
+                            out << '\\';
+                        out << (c == '\n' ? 'n' : c);
+                    }
+                    out << '"';
+                }
+            }
+            else if (auto *in = std::get_if<integer>(next))
+                out << format(buf, *in);
+            else if (auto *re = std::get_if<real>(next))
+                out << format(buf, *re);
+            if (open.empty())
+                return out;
+            out << ",";
+        }
+
+        // Close every list whose children have all been printed, then move on
+        // to the next child of the innermost list that is still open.
+
+        while (open.back().second == open.back().first->size()) {
+            out << "\b)";
+            open.pop_back();
+            if (open.empty())
+                return out;
+            out << ",";
+        }
+        auto &[li, idx] = open.back();
+        next = &(*li)[idx++];
     }
 }
 
@@ -0,0 +1,176 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+#pragma once
+
+namespace sexpr {
+
+// Tracing records when reading, each compiler pass and each invocation of
+// compiled code began and ended, for dump() to write out as a Chrome trace
+// that chrome://tracing or Perfetto can show on a timeline. It is off until
+// enabled, and costs a relaxed load per scope while off.
+//
+// Every thread records into a ring buffer of its own, which nothing but that
+// thread writes, so recording takes no locks. Only the most recent events of
+// each thread are kept once its buffer is full.
+
+namespace trace {
+
+struct event {
+    const char *name;
+    const char *category;
+    uint64_t begin;
+    uint64_t end;
+};
+
+namespace {
+constexpr size_t capacity = 1 << 14;
+
+// The fields of each slot are atomic so that dump() may read them while the
+// thread that owns the buffer is writing them. Slots that the writer may have
+// reached in the meantime are discarded.
+
+struct ring {
+    struct slot {
+        std::atomic<const char *> name{nullptr};
+        std::atomic<const char *> category{nullptr};
+        std::atomic<uint64_t> begin{0};
+        std::atomic<uint64_t> end{0};
+    };
+
+    explicit ring(size_t thread)
+    : thread{thread}
+    , slots(capacity) {}
+
+    void push(const event &ev) {
+        size_t at = head.load(std::memory_order_relaxed);
+        auto &slot = slots[at % capacity];
+        slot.name.store(ev.name, std::memory_order_relaxed);
+        slot.category.store(ev.category, std::memory_order_relaxed);
+        slot.begin.store(ev.begin, std::memory_order_relaxed);
+        slot.end.store(ev.end, std::memory_order_relaxed);
+        head.store(at + 1, std::memory_order_release);
+    }
+
+    std::vector<event> events() const {
+        size_t last = head.load(std::memory_order_acquire);
+        size_t first = last > capacity ? last - capacity : 0;
+        std::vector<event> res;
+        for (size_t at = first; at < last; ++at) {
+            auto &slot = slots[at % capacity];
+            res.push_back({slot.name.load(std::memory_order_relaxed),
+                           slot.category.load(std::memory_order_relaxed),
+                           slot.begin.load(std::memory_order_relaxed),
+                           slot.end.load(std::memory_order_relaxed)});
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        size_t now = head.load(std::memory_order_relaxed);
+        size_t overwritten = now > capacity ? now - capacity : 0;
+        if (overwritten > first)
+            res.erase(res.begin(), res.begin() + std::min(overwritten - first, res.size()));
+        return res;
+    }
+
+    const size_t thread;
+    std::vector<slot> slots;
+    std::atomic<size_t> head{0};
+};
+
+std::atomic<bool> enabled{false};
+
+// The buffers of every thread that has recorded anything, which outlive their
+// threads so that their events can still be dumped.
+
+struct registry {
+    std::mutex lock;
+    std::vector<std::shared_ptr<ring>> rings;
+};
+
+registry &rings() {
+    static registry res;
+    return res;
+}
+
+ring &local() {
+    thread_local std::shared_ptr<ring> res = [] {
+        auto &reg = rings();
+        std::lock_guard<std::mutex> lock{reg.lock};
+        reg.rings.push_back(std::make_shared<ring>(reg.rings.size() + 1));
+        return reg.rings.back();
+    }();
+    return *res;
+}
+
+uint64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+};
+
+void enable(bool on = true) { enabled.store(on, std::memory_order_relaxed); }
+bool active() { return enabled.load(std::memory_order_relaxed); }
+
+// Record the time from construction to destruction as an event. The name and
+// category must outlive the trace, as only the pointers are kept.
+
+class scope {
+public:
+    explicit scope(const char *name, const char *category = "weasel")
+    : m_name{name}
+    , m_category{category}
+    , m_begin{active() ? now() : 0} {}
+
+    scope(const scope &) = delete;
+    scope &operator =(const scope &) = delete;
+
+    ~scope() {
+        if (m_begin)
+            local().push({m_name, m_category, m_begin, now()});
+    }
+private:
+    const char *m_name;
+    const char *m_category;
+    uint64_t m_begin;
+};
+
+// Write the events recorded so far as a Chrome trace in the JSON object
+// format, with times in microseconds.
+
+std::ostream &dump(std::ostream &out)
+{
+    std::vector<std::shared_ptr<ring>> all;
+    {
+        auto &reg = rings();
+        std::lock_guard<std::mutex> lock{reg.lock};
+        all = reg.rings;
+    }
+
+    auto flags = out.flags();
+    auto precision = out.precision();
+    out << "{\"traceEvents\":[";
+    bool first = true;
+    for (const auto &ring : all) {
+        for (const auto &ev : ring->events()) {
+            out << (first ? "\n" : ",\n") << std::fixed << std::setprecision(3)
+                << "{\"name\":\"" << ev.name << "\",\"cat\":\"" << ev.category
+                << "\",\"ph\":\"X\",\"ts\":" << ev.begin / 1e3
+                << ",\"dur\":" << (ev.end - ev.begin) / 1e3
+                << ",\"pid\":1,\"tid\":" << ring->thread << "}";
+            first = false;
+        }
+    }
+    out.flags(flags);
+    out.precision(precision);
+    return out << "\n],\"displayTimeUnit\":\"ns\"}\n";
+}
+
+};
+
+};
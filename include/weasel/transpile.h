@@ -0,0 +1,466 @@
+#include "compile.h"
+#include <dlfcn.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <set>
+
+#pragma once
+
+namespace sexpr {
+
+// Options for translating expressions to C++ and building them with the system
+// compiler, which is run directly with the flags as its arguments rather than
+// through a shell. The generated code includes stream.h from the include
+// directory, which must be an absolute path. It defaults to WEASEL_INCLUDE_DIR
+// where the build defines it, and otherwise to the directory that this header
+// was found in when the compiler named it by an absolute path. The shared
+// objects are kept in the cache directory, which defaults to weasel in the
+// user's cache directory.
+
+struct transpile_options {
+    std::string compiler = "c++";
+    std::vector<std::string> flags = {"-std=c++17", "-O2"};
+    std::string include;
+    std::string cache;
+};
+
+namespace {
+// The entry point of a translated expression. The builtins that it calls are
+// looked up in the table in this process, as in the call table of an image, so
+// that the shared object does not depend on where anything was loaded.
+
+using transpiled_entry = void (*)(operand_stack *stack, const std::vector<object> *args,
+                                  const std::vector<object> *immediates,
+                                  void (*const *table)(operand_stack *),
+                                  bool (*dispatch)(operand_stack *, const context *, uint32_t),
+                                  const context *ctx);
+
+// The translator writes an expression as a function of straight line C++, in
+// the order that compiled code would evaluate it. Every value is held in a
+// local of its own, unboxed where its type is a number, and arithmetic on
+// numbers of the same type is written inline unless define() has replaced it.
+
+class translator {
+public:
+    std::string translate(const list &root, const typing &types)
+    {
+        struct value {
+            std::string name;
+            type ty;
+        };
+        struct frame {
+            std::reference_wrapper<const list> parent;
+            list::const_iterator it;
+            std::vector<value> args;
+        };
+        std::vector<struct frame> frames = {{root, root.begin(), {}}};
+
+        std::ostringstream code;
+        size_t locals = 0;
+        auto local = [&](type ty) {
+            std::string name = "v" + std::to_string(locals++);
+            code << "    " << (ty == type::integer ? "const integer " : ty == type::real ? "const real " : "object ")
+                 << name << " = ";
+            return value{name, ty};
+        };
+        auto take = [&](type ty) {
+            auto res = local(ty);
+            if (ty == type::integer || ty == type::real)
+                code << "*std::get_if<" << (ty == type::integer ? "integer" : "real") << ">(&stack->back());\n";
+            else
+                code << "std::move(stack->back());\n";
+            code << "    stack->pop_back();\n";
+            return res;
+        };
+        auto push = [&](const value &val) {
+            code << "    stack->push_back(" << (val.ty == type::integer || val.ty == type::real
+                                                ? val.name : "std::move(" + val.name + ")") << ");\n";
+        };
+
+        for (;;) {
+            auto &top = frames.back();
+            if (top.it == top.parent.get().end()) {
+                const list &call = top.parent.get();
+                const signature *sig = types.calls.at(&call);
+                std::vector<type> operands;
+                for (const auto &arg : top.args)
+                    operands.push_back(arg.ty);
+
+                value res;
+                if (sig && sig->async)
+                    throw std::runtime_error("transpile: Asynchronous builtins are not supported.");
+                if (sig && inline_op(*sig)) {
+                    res = local(sig->result);
+                    code << top.args[0].name << " " << call.op << " " << top.args[1].name << ";\n";
+                }
+                else if (sig) {
+                    for (const auto &arg : top.args)
+                        push(arg);
+                    code << "    table[" << slot(sig->symbol) << "](stack);\n";
+                    res = take(sig->result);
+                }
+                else {
+                    type result;
+                    dispatched(signatures, call.op, operands, result);
+                    m_dispatches.emplace_back(call.op, call.size());
+                    for (const auto &arg : top.args)
+                        push(arg);
+                    code << "    if (!dispatch(stack, ctx, " << m_dispatches.size() - 1 << "))\n"
+                         << "        return;\n";
+                    res = take(result);
+                }
+
+                frames.pop_back();
+                if (frames.empty()) {
+                    push(res);
+                    break;
+                }
+                frames.back().args.push_back(res);
+                frames.back().it++;
+                continue;
+            }
+
+            auto *li = std::get_if<list>(&*top.it);
+            if (li && !li->op.empty()) {
+                frames.push_back(frame{*li, li->begin(), {}});
+                continue;
+            }
+
+            // Parameters have been coerced to their annotated types before the
+            // call, and numbers are written as literals. Everything else is
+            // copied from the constants.
+
+            uint32_t idx;
+            type ty;
+            auto *at = std::get_if<atom>(&*top.it);
+            if (at && parameter(*at, idx, ty)) {
+                ty = types.params[idx];
+                auto val = local(ty);
+                if (ty == type::integer || ty == type::real)
+                    code << "*std::get_if<" << (ty == type::integer ? "integer" : "real") << ">(&(*args)["
+                         << idx << "]);\n";
+                else
+                    code << "(*args)[" << idx << "];\n";
+                top.args.push_back(val);
+            }
+            else {
+                object lit = at ? literal(*at) : *top.it;
+                auto *in = std::get_if<integer>(&lit);
+                auto *re = std::get_if<real>(&lit);
+                if (in) {
+                    top.args.push_back(local(type::integer));
+                    code << "integer(INT64_C(" << (*in == std::numeric_limits<integer>::min()
+                                                   ? "-9223372036854775807) - 1" : std::to_string(*in) + ")")
+                         << ");\n";
+                }
+                else if (re && std::isfinite(*re)) {
+                    char buf[64];
+                    snprintf(buf, sizeof(buf), "%a", *re);
+                    top.args.push_back(local(type::real));
+                    code << buf << ";\n";
+                }
+                else {
+                    top.args.push_back(local(type_of(lit)));
+                    code << "(*immediates)[" << m_immediates.size() << "];\n";
+                    m_immediates.push_back(std::move(lit));
+                }
+            }
+            top.it++;
+        }
+
+        std::ostringstream out;
+        out << "#include <weasel/stream.h>\n"
+            << "#include <cstdint>\n\n"
+            << "namespace sexpr { struct context; }\n"
+            << "using namespace sexpr;\n\n"
+            << "extern \"C\" void weasel_eval(operand_stack *stack, const std::vector<object> *args,\n"
+            << "                            const std::vector<object> *immediates,\n"
+            << "                            void (*const *table)(operand_stack *),\n"
+            << "                            bool (*dispatch)(operand_stack *, const context *, uint32_t),\n"
+            << "                            const context *ctx)\n"
+            << "{\n" << code.str() << "}\n";
+        return out.str();
+    }
+
+    std::vector<std::string> &table() { return m_table; }
+    std::vector<object> &immediates() { return m_immediates; }
+    std::vector<std::pair<std::string, size_t>> &dispatches() { return m_dispatches; }
+private:
+    // The builtin arithmetic on two numbers of the same type, as long as it
+    // has not been replaced.
+
+    static bool inline_op(const signature &sig)
+    {
+        static const char *ops[] = { "+/int", "+/real", "*/int", "*/real" };
+        for (const char *op : ops) {
+            if (sig.symbol == op)
+                return resolve(sig.symbol) == builtins.at(sig.symbol);
+        }
+        return false;
+    }
+
+    size_t slot(const std::string &symbol)
+    {
+        auto found = std::find(m_table.begin(), m_table.end(), symbol);
+        if (found != m_table.end())
+            return found - m_table.begin();
+        m_table.push_back(symbol);
+        return m_table.size() - 1;
+    }
+
+    std::vector<std::string> m_table;
+    std::vector<object> m_immediates;
+    std::vector<std::pair<std::string, size_t>> m_dispatches;
+};
+
+// FNV-1a, which is good enough to tell sources apart in the cache.
+
+static uint64_t fingerprint(const std::string &data, uint64_t hash = 0xcbf29ce484222325)
+{
+    for (unsigned char c : data)
+        hash = (hash ^ c) * 0x100000001b3;
+    return hash;
+}
+
+static std::string default_include()
+{
+#ifdef WEASEL_INCLUDE_DIR
+    return WEASEL_INCLUDE_DIR;
+#else
+    std::filesystem::path header = __FILE__;
+    if (!header.is_absolute())
+        return {};
+    return header.parent_path().parent_path().string();
+#endif
+}
+
+// Hash a header of the include directory and every header that it includes
+// from there, once each, as any of them may change the layout of what the
+// generated code is handed.
+
+static uint64_t fingerprint_headers(const std::filesystem::path &dir, const std::string &name,
+                                    std::set<std::string> &seen, uint64_t hash)
+{
+    if (!seen.insert(name).second)
+        return hash;
+    std::ifstream in(dir / name, std::ios::binary);
+    if (!in)
+        throw std::runtime_error("transpile: Cannot find " + name + ".");
+    std::ostringstream text;
+    text << in.rdbuf();
+    hash = fingerprint(text.str(), fingerprint(name, hash));
+
+    std::istringstream lines(text.str());
+    for (std::string line; std::getline(lines, line);) {
+        size_t at = line.find_first_not_of(" \t");
+        if (at == std::string::npos || line.compare(at, 8, "#include") != 0)
+            continue;
+        size_t open = line.find('"', at + 8);
+        size_t close = open == std::string::npos ? open : line.find('"', open + 1);
+        if (close != std::string::npos)
+            hash = fingerprint_headers(dir, line.substr(open + 1, close - open - 1), seen, hash);
+    }
+    return hash;
+}
+
+// Run the compiler with the given arguments and wait for it, returning whether
+// it succeeded.
+
+static bool run(const std::vector<std::string> &argv)
+{
+    std::vector<char *> args;
+    for (const auto &arg : argv)
+        args.push_back(const_cast<char *>(arg.c_str()));
+    args.push_back(nullptr);
+
+    pid_t pid;
+    if (posix_spawnp(&pid, args[0], nullptr, nullptr, args.data(), environ) != 0)
+        return false;
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR)
+            return false;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static std::string default_cache()
+{
+    if (const char *dir = getenv("XDG_CACHE_HOME"); dir && *dir)
+        return std::string(dir) + "/weasel";
+    if (const char *home = getenv("HOME"); home && *home)
+        return std::string(home) + "/.cache/weasel";
+    return "/tmp/weasel";
+}
+};
+
+// An expression that was translated to C++ and built into a shared object by
+// the system compiler. It is called like a native_function, and like one holds
+// on to its code for as long as any copy of it is alive.
+
+class transpiled_function {
+public:
+    object operator ()(std::vector<object> args = {}) const {
+        const auto &params = m_library->params;
+        if (args.size() < params.size())
+            throw std::invalid_argument("native_function: Too few arguments.");
+        for (size_t i = 0; i < params.size(); ++i)
+            coerce(args[i], params[i]);
+
+        operand_stack stack;
+        std::exception_ptr error;
+        context ctx{};
+        ctx.caches = m_library->caches.get();
+        ctx.error = &error;
+        m_library->entry(&stack, &args, &m_library->immediates, m_library->table.data(),
+                         do_dispatch, &ctx);
+        if (error)
+            std::rethrow_exception(error);
+        return stack.empty() ? object{atom{}} : std::move(stack.back());
+    }
+
+    const std::vector<type> &params() const { return m_library->params; }
+
+    // The shared object that the code was loaded from.
+
+    const std::string &path() const { return m_library->path; }
+
+    // The inline caches of the calls that are dispatched at runtime.
+
+    std::vector<cache_stats> caches() const {
+        std::vector<cache_stats> res;
+        for (size_t i = 0; i < m_library->dispatches; ++i) {
+            const auto &ic = m_library->caches[i];
+            res.push_back({ic.name, ic.hits.load(std::memory_order_relaxed),
+                           ic.misses.load(std::memory_order_relaxed)});
+        }
+        return res;
+    }
+private:
+    friend transpiled_function transpile(const list &, const transpile_options &);
+
+    struct library {
+        library() = default;
+        library(const library &) = delete;
+        library &operator =(const library &) = delete;
+
+        ~library() {
+            if (handle)
+                dlclose(handle);
+        }
+
+        void *handle = nullptr;
+        transpiled_entry entry = nullptr;
+        std::vector<void (*)(operand_stack *)> table;
+        std::vector<object> immediates;
+        std::unique_ptr<inline_cache[]> caches;
+        size_t dispatches = 0;
+        std::vector<type> params;
+        std::string path;
+    };
+
+    explicit transpiled_function(std::shared_ptr<const library> library)
+    : m_library{std::move(library)} {}
+
+    std::shared_ptr<const library> m_library;
+};
+
+// Translate an expression to C++, build it with the system compiler unless the
+// cache already holds it, and load it. Building takes on the order of a second,
+// so this is only worth it for the hottest expressions, such as those that an
+// adaptive_function has been called the most with. The cache is keyed by the
+// generated source, the compiler command, and stream.h and the headers that it
+// includes, which define the layout of the objects that are passed in, so any
+// of them changing makes a new entry.
+
+transpiled_function transpile(const list &root, const transpile_options &options = {})
+{
+    typing types = infer(root, signatures);
+    std::string include = options.include.empty() ? default_include() : options.include;
+    if (!std::filesystem::path(include).is_absolute())
+        throw std::invalid_argument("transpile: The include directory must be an absolute path, "
+                                    "given by transpile_options::include or WEASEL_INCLUDE_DIR.");
+    std::string cache = options.cache.empty() ? default_cache() : options.cache;
+
+    translator tr;
+    std::string source = tr.translate(root, types);
+    std::vector<std::string> command = {options.compiler};
+    command.insert(command.end(), options.flags.begin(), options.flags.end());
+    command.insert(command.end(), {"-fPIC", "-shared", "-I", include});
+
+    uint64_t hash = fingerprint(source);
+    for (const auto &arg : command)
+        hash = fingerprint(std::string(1, '\0'), fingerprint(arg, hash));
+    std::set<std::string> seen;
+    hash = fingerprint_headers(std::filesystem::path(include) / "weasel", "stream.h", seen, hash);
+
+    char key[17];
+    snprintf(key, sizeof(key), "%016" PRIx64, hash);
+    std::filesystem::path dir = cache;
+    std::filesystem::path path = dir / (std::string(key) + ".so");
+
+    // Build into a file of our own and rename it into place, so that threads
+    // and processes building the same expression at once never load a partial
+    // object. The source is created with a unique name, which the object
+    // shares until it has been moved into place.
+
+    if (!std::filesystem::exists(path)) {
+        std::filesystem::create_directories(dir);
+        std::string name = (dir / (std::string(key) + ".XXXXXX.cpp")).string();
+        int fd = mkstemps(name.data(), 4);
+        if (fd < 0)
+            throw std::runtime_error("transpile: Cannot create source.");
+        std::string tmp = name.substr(0, name.size() - 4);
+        {
+            FILE *out = fdopen(fd, "w");
+            bool written = out && fwrite(source.data(), 1, source.size(), out) == source.size();
+            if (out ? fclose(out) : close(fd))
+                written = false;
+            if (!written) {
+                std::filesystem::remove(name);
+                throw std::runtime_error("transpile: Cannot write source.");
+            }
+        }
+        command.insert(command.end(), {name, "-o", tmp + ".so"});
+        bool built;
+        {
+            trace::scope timed{"c++"};
+            built = run(command);
+        }
+        if (!built) {
+            std::filesystem::remove(tmp + ".so");
+            std::filesystem::remove(name);
+            throw std::runtime_error("transpile: Compiler failed.");
+        }
+        std::filesystem::rename(tmp + ".so", path);
+        std::filesystem::remove(name);
+    }
+
+    auto lib = std::make_shared<transpiled_function::library>();
+    lib->path = path.string();
+    lib->handle = dlopen(lib->path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!lib->handle)
+        throw std::runtime_error("transpile: Cannot load shared object.");
+    lib->entry = reinterpret_cast<transpiled_entry>(dlsym(lib->handle, "weasel_eval"));
+    if (!lib->entry)
+        throw std::runtime_error("transpile: Missing entry point.");
+
+    for (const auto &name : tr.table())
+        lib->table.push_back(reinterpret_cast<void (*)(operand_stack *)>(resolve(name)));
+    lib->immediates = std::move(tr.immediates());
+    lib->dispatches = tr.dispatches().size();
+    lib->caches = std::make_unique<inline_cache[]>(lib->dispatches);
+    for (size_t i = 0; i < lib->dispatches; ++i)
+        fill(lib->caches[i], tr.dispatches()[i].first, tr.dispatches()[i].second);
+    lib->params = std::move(types.params);
+    return transpiled_function{std::move(lib)};
+}
+
+};
@@ -0,0 +1,137 @@
+#include <optional>
+#include <stdexcept>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "stream.h"
+
+#pragma once
+
+namespace sexpr {
+
+// The first structural error in a source, and the offset at which it was found.
+
+struct fault {
+    size_t offset;
+    const char *what;
+};
+
+namespace {
+// A mask of the bytes in the 16 starting at p that equal any of a, b or c.
+
+static unsigned matches(const char *p, char a, char b, char c)
+{
+#ifdef __SSE2__
+    __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    __m128i any = _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8(a)),
+                               _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8(b)),
+                                            _mm_cmpeq_epi8(block, _mm_set1_epi8(c))));
+    return _mm_movemask_epi8(any);
+#else
+    unsigned mask = 0;
+    for (int i = 0; i < 16; ++i)
+        mask |= unsigned(p[i] == a || p[i] == b || p[i] == c) << i;
+    return mask;
+#endif
+}
+
+static bool delimiter(char c)
+{
+    return c == '\n' || c == ',' || c == '(' || c == ')';
+}
+};
+
+// Check that the parentheses of a source balance and that its string literals
+// are well formed, as read() would, without building anything. The source is
+// scanned 16 bytes at a time for the characters that matter in the current
+// state, which outside of literals are parentheses and quotes, and inside them
+// quotes and backslashes, so that most bytes are never looked at one by one.
+
+std::optional<fault> validate(std::string_view src)
+{
+    const char *p = src.data();
+    size_t n = src.size();
+    size_t depth = 0;
+    size_t literal = 0;
+    bool quoted = false;
+
+    size_t i = 0;
+    while (i < n) {
+        if (n - i >= 16) {
+            unsigned mask = quoted ? matches(p + i, '"', '\\', '"') : matches(p + i, '(', ')', '"');
+            if (!mask) {
+                i += 16;
+                continue;
+            }
+            i += __builtin_ctz(mask);
+        }
+
+        char c = p[i];
+        if (quoted) {
+            if (c == '\\')
+                ++i;
+            else if (c == '"') {
+                quoted = false;
+                if (i + 1 < n && !delimiter(p[i + 1]))
+                    return fault{i + 1, "Characters after a string literal"};
+            }
+        }
+        else if (c == '(')
+            ++depth;
+        else if (c == ')') {
+            if (!depth)
+                return fault{i, "Unbalanced parenthesis"};
+            --depth;
+        }
+        else if (c == '"' && (i == 0 || delimiter(p[i - 1]))) {
+            quoted = true;
+            literal = i;
+        }
+        ++i;
+    }
+    if (quoted)
+        return fault{literal, "Unterminated string literal"};
+    if (depth)
+        return fault{n, "Unbalanced parenthesis"};
+    return std::nullopt;
+}
+
+// Throw if a source is structurally broken, naming the line and column of the
+// first fault as read() would.
+
+void check(std::string_view src)
+{
+    if (auto bad = validate(src)) {
+        size_t line = 1, start = 0;
+        for (size_t k = src.find('\n'); k < bad->offset; k = src.find('\n', k + 1)) {
+            ++line;
+            start = k + 1;
+        }
+        throw std::runtime_error(std::string("read: ") + bad->what + " at " + std::to_string(line) + ":"
+                                 + std::to_string(bad->offset - start + 1) + ".");
+    }
+}
+
+// Read an expression from memory, rejecting a source that is structurally
+// broken before anything is built for it. The source is read in place rather
+// than copied into a stream.
+
+object read(std::string_view src, std::pmr::memory_resource *resource = std::pmr::get_default_resource(),
+            locations *where = nullptr)
+{
+    check(src);
+
+    struct view : std::streambuf {
+        explicit view(std::string_view src) {
+            char *p = const_cast<char *>(src.data());
+            setg(p, p, p + src.size());
+        }
+    } buf{src};
+    std::istream is{&buf};
+    return read(is, resource, where);
+}
+
+};
@@ -0,0 +1,78 @@
+// Errors raised by builtins must come out of compiled code as exceptions
+// rather than terminating the process.
+//
+//     g++ -std=c++20 -Iinclude/weasel test/errors.cpp -lpthread -o errors
+
+#include "adaptive.h"
+#include "pipeline.h"
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+
+using namespace sexpr;
+
+static int failures = 0;
+
+static list parse(const std::string &text)
+{
+    std::istringstream is(text);
+    return std::get<list>(read(is));
+}
+
+template<typename F>
+static void expect_throw(const char *what, F &&f)
+{
+    try {
+        f();
+        std::cerr << what << ": Nothing thrown.\n";
+        ++failures;
+    }
+    catch (const std::invalid_argument &) {}
+}
+
+int main()
+{
+    // A generic builtin called directly.
+
+    auto add = compile(parse("+($0,1)"));
+    expect_throw("builtin", [&] { add({atom("x")}); });
+    if (add({integer(1)}) != object(integer(2))) {
+        std::cerr << "builtin: Wrong result after an error.\n";
+        ++failures;
+    }
+
+    // Profiled baseline code, and a guard that falls back to the generic
+    // implementation once the code has been specialized for integers.
+
+    adaptive_function adaptive(parse("+($0,1)"), 4);
+    expect_throw("profile", [&] { adaptive({atom("x")}); });
+    for (int i = 0; i < 8; ++i)
+        adaptive({integer(i)});
+    expect_throw("guard", [&] { adaptive({atom("x")}); });
+
+    // A row of a pipeline.
+
+    auto filter = compile(parse("+($0,1)"), {}, {type::any});
+    batch input;
+    input.columns.emplace_back(std::vector<object>{integer(1), atom("x")});
+    expect_throw("pipeline", [&] { filter(input); });
+
+    // Evaluations on an event loop complete with the error, whether the code
+    // or an asynchronous builtin threw, and are no longer held.
+
+    define("fail", 1, type::any, [](std::vector<object>, std::function<void(object)>) {
+        throw std::invalid_argument("fail: Failed.");
+    });
+    event_loop loop;
+    int errors = 0;
+    auto done = [&](object, std::exception_ptr error) { errors += bool(error); };
+    compile(parse("fail($0)")).start(loop, {integer(1)}, done);
+    add.start(loop, {atom("x")}, done);
+    loop.run();
+    if (errors != 2 || loop.held()) {
+        std::cerr << "event loop: Errors not completed.\n";
+        ++failures;
+    }
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}